@@ -1,99 +1,346 @@
 #include "BVH.h"
 #include "Triangle.h"
+#include "ThreadPool.h"
+#include "Morton.h"
 #include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+
+/* Ranges are reduced and partitioned by chunks of this size. The chunking
+ * does not depend on the thread count, so parallel builds give the exact
+ * same tree as serial ones. */
+#define BUILD_CHUNK 4096
+
+/* Subtrees of the Morton radix tree this small become LBVH leaves */
+#define LBVH_LEAF_SIZE 4
 
 unsigned int BVH::max_density = 500;
-unsigned int BVH::nodes = 0;
-unsigned int BVH::leaves = 0;
 
-BVH::BVH() : mesh(NULL) {}
+/* Bounds and triangle count of a set of triangles (a node or a SAH bin) */
+struct SAHBin {
+    Vec3f low;
+    Vec3f upp;
+    unsigned int count;
 
-BVH::BVH(const Mesh &_mesh) : mesh(&_mesh) {
-    std::vector<Vec3f> positions = mesh->positions();
-    std::vector<Triangle> triangles = mesh->triangles();
+    SAHBin() : low(FLT_MAX, FLT_MAX, FLT_MAX),
+        upp(-FLT_MAX, -FLT_MAX, -FLT_MAX), count(0) {}
 
-    std::vector<int> t(triangles.size());
-    for (unsigned int i = 0; i < triangles.size(); i++) {
-        t[i] = i;
+    void extend(const Vec3f &l, const Vec3f &u) {
+        for (int k = 0; k < 3; k++) {
+            low[k] = std::min(low[k], l[k]);
+            upp[k] = std::max(upp[k], u[k]);
+        }
     }
 
-    tri_index = t;
+    void merge(const SAHBin &bin) {
+        extend(bin.low, bin.upp);
+        count += bin.count;
+    }
 
-    float maxX = FLT_MIN, maxY = FLT_MIN, maxZ = FLT_MIN;
-    float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX;
-    Vec3f meanPos = Vec3f(0.0,0.0,0.0);
+    float area() const {
+        if (count == 0)
+            return 0.f;
+        Vec3f d = upp - low;
+        return 2.f * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+    }
+};
+
+/* Triangle and barycenter bounds of a node, with the barycenters' sum */
+struct NodeBounds {
+    SAHBin box;
+    SAHBin centroids;
+    Vec3f barycenterSum;
+
+    void merge(const NodeBounds &b) {
+        box.merge(b.box);
+        centroids.merge(b.centroids);
+        barycenterSum += b.barycenterSum;
+    }
+};
+
+/* Radix tree over sorted Morton codes. Internal node k splits its range
+ * between triangles k and k + 1, where the codes share prefix[k] bits.
+ * A missing child (-1) stands for the leaf k or k + 1. */
+struct MortonTree {
+    std::vector<unsigned int> prefix;
+    std::vector<int> left;
+    std::vector<int> right;
+};
+
+/* Top-down builder. Triangles are split by reordering the BVH index array
+ * in place, so every node only deals with a [begin, end) range of it.
+ * Large subtrees are built on the thread pool, each into its own node
+ * array that is then spliced in depth-first order. */
+class BVHBuilder {
+    private :
+        BVH &bvh;
+        const BVHParams &params;
+        ThreadPool &pool;
+
+        /* Per-triangle bounds and barycenters, computed once */
+        std::vector<Vec3f> lows;
+        std::vector<Vec3f> upps;
+        std::vector<Vec3f> barycenters;
+
+        bool parallel(unsigned int begin, unsigned int end) const {
+            return params.parallelThreshold > 0 && pool.size() > 1
+                && end - begin >= params.parallelThreshold;
+        }
 
-    for (unsigned int i = 0; i < positions.size(); i++) {
-        Vec3f currentPos = positions[i];
+        /* Runs f on every chunk of [begin, end), in parallel for ranges
+         * large enough */
+        template <typename F>
+        void forChunks(unsigned int begin, unsigned int end, F f) {
+            unsigned int chunks = (end - begin + BUILD_CHUNK - 1)
+                / BUILD_CHUNK;
+            if (chunks > 1 && parallel(begin, end)) {
+                pool.parallelFor(0, chunks, 1,
+                        [&] (unsigned int c0, unsigned int c1) {
+                    for (unsigned int c = c0; c < c1; c++) {
+                        unsigned int b = begin + c * BUILD_CHUNK;
+                        f(c, b, std::min(end, b + BUILD_CHUNK));
+                    }
+                });
+            } else {
+                for (unsigned int c = 0; c < chunks; c++) {
+                    unsigned int b = begin + c * BUILD_CHUNK;
+                    f(c, b, std::min(end, b + BUILD_CHUNK));
+                }
+            }
+        }
 
-        meanPos += currentPos;
+        /* Same, returning the per-chunk results in order */
+        template <typename Result, typename F>
+        std::vector<Result> mapChunks(unsigned int begin, unsigned int end,
+                                      F f) {
+            std::vector<Result> results((end - begin + BUILD_CHUNK - 1)
+                    / BUILD_CHUNK);
+            forChunks(begin, end,
+                    [&] (unsigned int c, unsigned int b, unsigned int e) {
+                results[c] = f(b, e);
+            });
+            return results;
+        }
 
-        /* Updating maximal values */
-        if (currentPos[0] < minX)
-            minX = currentPos[0];
-        if (currentPos[1] < minY)
-            minY = currentPos[1];
-        if (currentPos[2] < minZ)
-            minZ = currentPos[2];
-        if (currentPos[0] > maxX)
-            maxX = currentPos[0];
-        if (currentPos[1] > maxY)
-            maxY = currentPos[1];
-        if (currentPos[0] > maxZ)
-            maxZ = currentPos[2];
-    }
+        NodeBounds computeBounds(unsigned int begin, unsigned int end);
+        unsigned int splitMean(unsigned int begin, unsigned int end,
+                               const NodeBounds &bounds);
+        unsigned int splitSAH(unsigned int begin, unsigned int end,
+                              const NodeBounds &bounds);
+
+        /* Stable partition of the range, so results never depend on the
+         * order in which chunks were processed */
+        template <typename Predicate>
+        unsigned int partition(unsigned int begin, unsigned int end,
+                               Predicate pred);
+
+        unsigned int emitLBVH(const MortonTree &tree, int node,
+                              unsigned int first, unsigned int last,
+                              unsigned int depth, std::vector<BVHNode> &out);
+
+    public :
+        BVHBuilder(BVH &_bvh, const BVHParams &_params);
+        unsigned int build(unsigned int begin, unsigned int end,
+                           unsigned int depth, std::vector<BVHNode> &out);
+        void buildLBVH(std::vector<BVHNode> &out);
+};
+
+BVHBuilder::BVHBuilder(BVH &_bvh, const BVHParams &_params) :
+    bvh(_bvh), params(_params), pool(ThreadPool::instance()) {
+    const MeshArray<Vec3f> &positions = bvh.mesh->positions();
+    const MeshArray<Triangle> &triangles = bvh.mesh->triangles();
+
+    lows.resize(triangles.size());
+    upps.resize(triangles.size());
+    barycenters.resize(triangles.size());
+
+    forChunks(0, triangles.size(),
+            [&] (unsigned int, unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            const Vec3f &p0 = positions[triangles[i][0]];
+            const Vec3f &p1 = positions[triangles[i][1]];
+            const Vec3f &p2 = positions[triangles[i][2]];
+
+            for (int k = 0; k < 3; k++) {
+                lows[i][k] = std::min(p0[k], std::min(p1[k], p2[k]));
+                upps[i][k] = std::max(p0[k], std::max(p1[k], p2[k]));
+            }
+            barycenters[i] = (p0 + p1 + p2) / 3.f;
+        }
+    });
+}
 
-    meanPos *= 1.f/(float) positions.size();
+NodeBounds BVHBuilder::computeBounds(unsigned int begin, unsigned int end) {
+    const std::vector<int> &tri_index = bvh.tri_index;
+
+    std::vector<NodeBounds> partials = mapChunks<NodeBounds>(begin, end,
+            [&] (unsigned int b, unsigned int e) {
+        NodeBounds bounds;
+        for (unsigned int i = b; i < e; i++) {
+            int j = tri_index[i];
+            bounds.box.extend(lows[j], upps[j]);
+            bounds.centroids.extend(barycenters[j], barycenters[j]);
+            bounds.barycenterSum += barycenters[j];
+        }
+        bounds.box.count = bounds.centroids.count = e - b;
+        return bounds;
+    });
+
+    NodeBounds bounds;
+    for (unsigned int c = 0; c < partials.size(); c++)
+        bounds.merge(partials[c]);
+    return bounds;
+}
 
-    Vec3f lowPos = Vec3f(minX, minY, minZ);
-    Vec3f uppPos = Vec3f(maxX, maxY, maxZ);
+template <typename Predicate>
+unsigned int BVHBuilder::partition(unsigned int begin, unsigned int end,
+        Predicate pred) {
+    std::vector<int> &tri_index = bvh.tri_index;
+
+    if (!parallel(begin, end)) {
+        std::vector<int>::iterator first = tri_index.begin();
+        return std::stable_partition(first + begin, first + end, pred)
+            - first;
+    }
 
-    bBox = BoundingBox(lowPos, uppPos, meanPos);
+    /* Counting each chunk's first-side triangles gives where every chunk
+     * scatters its two sides */
+    std::vector<unsigned int> counts = mapChunks<unsigned int>(begin, end,
+            [&] (unsigned int b, unsigned int e) {
+        unsigned int count = 0;
+        for (unsigned int i = b; i < e; i++)
+            count += pred(tri_index[i]) ? 1 : 0;
+        return count;
+    });
+
+    std::vector<unsigned int> firstOffsets(counts.size());
+    std::vector<unsigned int> secondOffsets(counts.size());
+    unsigned int firstCount = 0;
+    for (unsigned int c = 0; c < counts.size(); c++) {
+        firstOffsets[c] = firstCount;
+        firstCount += counts[c];
+    }
+    unsigned int secondCount = firstCount;
+    for (unsigned int c = 0; c < counts.size(); c++) {
+        secondOffsets[c] = secondCount;
+        secondCount += std::min(end, begin + (c + 1) * BUILD_CHUNK)
+            - (begin + c * BUILD_CHUNK) - counts[c];
+    }
 
-    std::vector<int> child_tri_index_1;
-    std::vector<int> child_tri_index_2;
-    BoundingBox child_box_1;
-    BoundingBox child_box_2;
+    std::vector<int> scattered(end - begin);
+    forChunks(begin, end,
+            [&] (unsigned int c, unsigned int b, unsigned int e) {
+        unsigned int first = firstOffsets[c];
+        unsigned int second = secondOffsets[c];
+        for (unsigned int i = b; i < e; i++) {
+            if (pred(tri_index[i]))
+                scattered[first++] = tri_index[i];
+            else
+                scattered[second++] = tri_index[i];
+        }
+    });
 
-    split(child_tri_index_1, child_tri_index_2, child_box_1, child_box_2);
+    forChunks(begin, end,
+            [&] (unsigned int, unsigned int b, unsigned int e) {
+        std::copy(scattered.begin() + (b - begin),
+                scattered.begin() + (e - begin), tri_index.begin() + b);
+    });
 
-    leftChild = new BVH(_mesh, child_tri_index_1, child_box_1);
-    rightChild = new BVH(_mesh, child_tri_index_2, child_box_2);
+    return begin + firstCount;
+}
 
-    nodes ++;
+/* Number of halvings that bring count triangles within a 16 bits leaf */
+static unsigned int leafHalvings(unsigned int count) {
+    unsigned int levels = 0;
+    for (; count > 0xffff; count -= count / 2)
+        levels++;
+    return levels;
 }
 
-BVH::BVH(const Mesh &_mesh, const std::vector<int> &_tri_index,
-        const BoundingBox &_bBox) :
-    mesh(&_mesh), tri_index(_tri_index), bBox(_bBox), leftChild(NULL),
-    rightChild(NULL) {
-        if (tri_index.size() > max_density) {
-            std::vector<int> child_tri_index_1;
-            std::vector<int> child_tri_index_2;
-            BoundingBox child_box_1;
-            BoundingBox child_box_2;
+/* Appends the subtree over [begin, end) to out and returns the index of its
+ * root. Interior node offsets are relative to the start of out. */
+unsigned int BVHBuilder::build(unsigned int begin, unsigned int end,
+        unsigned int depth, std::vector<BVHNode> &out) {
+    NodeBounds bounds = computeBounds(begin, end);
+    const SAHBin &box = bounds.box;
+
+    unsigned int index = out.size();
+    out.push_back(BVHNode());
+    for (int k = 0; k < 3; k++) {
+        out[index].low[k] = box.low[k];
+        out[index].upp[k] = box.upp[k];
+    }
+
+    /* Splitting stops early enough for the halvings below to stay within
+     * the traversal stacks */
+    unsigned int mid = begin;
+    if (depth + leafHalvings(end - begin) < BVH_STACK_SIZE - 2) {
+        if (params.method == BVHParams::SPLIT_SAH)
+            mid = splitSAH(begin, end, bounds);
+        else if (end - begin > BVH::max_density)
+            mid = splitMean(begin, end, bounds);
+    }
 
-            split(child_tri_index_1, child_tri_index_2,
-                    child_box_1, child_box_2);
+    /* Leaf counts are 16 bits, oversized leaves are cut in halves */
+    if ((mid == begin || mid == end) && end - begin > 0xffff)
+        mid = begin + (end - begin) / 2;
 
-            leftChild = new BVH(_mesh, child_tri_index_1, child_box_1);
-            rightChild = new BVH(_mesh, child_tri_index_2, child_box_2);
+    if (mid == begin || mid == end) {
+        out[index].offset = begin;
+        out[index].count = end - begin;
+        return index;
+    }
 
-            nodes ++;
+    Vec3f extent = box.upp - box.low;
+    int axis = 0;
+    if (extent[1] > extent[axis])
+        axis = 1;
+    if (extent[2] > extent[axis])
+        axis = 2;
+
+    unsigned int second;
+    if (parallel(begin, end)) {
+        /* The first subtree goes to the pool, the second one is built by
+         * this thread, then both are appended with their offsets fixed */
+        std::vector<BVHNode> firstNodes, secondNodes;
+        ThreadPool::TaskGroup group(pool);
+        group.run([&] {build(begin, mid, depth + 1, firstNodes);});
+        build(mid, end, depth + 1, secondNodes);
+        group.wait();
+
+        for (unsigned int i = 0; i < firstNodes.size(); i++) {
+            if (!firstNodes[i].isLeaf())
+                firstNodes[i].offset += index + 1;
+            out.push_back(firstNodes[i]);
         }
+        second = out.size();
+        for (unsigned int i = 0; i < secondNodes.size(); i++) {
+            if (!secondNodes[i].isLeaf())
+                secondNodes[i].offset += second;
+            out.push_back(secondNodes[i]);
+        }
+    } else {
+        build(begin, mid, depth + 1, out);
+        second = build(mid, end, depth + 1, out);
     }
 
-void BVH::split(std::vector<int> &child_tri_index_1,
-        std::vector<int> &child_tri_index_2,
-        BoundingBox &child_box_1, BoundingBox &child_box_2) {
+    out[index].offset = second;
+    out[index].count = 0;
+    out[index].axis = axis;
+    return index;
+}
 
-    std::vector<Vec3f> positions = mesh->positions();
-    std::vector<Triangle> triangles = mesh->triangles();
+/* Cuts the longest axis at the mean barycenter */
+unsigned int BVHBuilder::splitMean(unsigned int begin, unsigned int end,
+        const NodeBounds &bounds) {
+    const SAHBin &box = bounds.box;
+    Vec3f meanPos = bounds.barycenterSum / (float) (end - begin);
 
     /* Chosing largest dimension */
-    float x = bBox.uppCorner[0] - bBox.lowCorner[0];
-    float y = bBox.uppCorner[1] - bBox.lowCorner[1];
-    float z = bBox.uppCorner[2] - bBox.lowCorner[2];
+    float x = box.upp[0] - box.low[0];
+    float y = box.upp[1] - box.low[1];
+    float z = box.upp[2] - box.low[2];
 
     int splt;
     if(x>=y && x >=z)
@@ -103,82 +350,470 @@ void BVH::split(std::vector<int> &child_tri_index_1,
     else
         splt = 2;
 
-    /* Splitting triangles between the chidlren */
-    float maxX1 = FLT_MIN, maxY1 = FLT_MIN, maxZ1 = FLT_MIN;
-    float minX1 = FLT_MAX, minY1 = FLT_MAX, minZ1 = FLT_MAX;
-
-    float maxX2 = FLT_MIN, maxY2 = FLT_MIN, maxZ2 = FLT_MIN;
-    float minX2 = FLT_MAX, minY2 = FLT_MAX, minZ2 = FLT_MAX;
-
-    Vec3f meanPos1 = Vec3f(0,0,0);
-    Vec3f meanPos2 = Vec3f(0,0,0);
-
-    Vec3f meanPos = bBox.meanPos;
-
-    for(unsigned int i = 0; i < tri_index.size(); i++) {
-        Triangle currentTri = triangles[tri_index[i]];
-        Vec3f p0 = positions[currentTri[0]];
-        Vec3f p1 = positions[currentTri[1]];
-        Vec3f p2 = positions[currentTri[2]];
-        Vec3f barycenter = (p0 + p1 + p2) / 3.f;
-
-        if(barycenter[splt] > meanPos[splt]) {
-            child_tri_index_1.push_back(tri_index[i]);
-            meanPos1 += barycenter;
-
-            for(int k = 0; k < 3; k++) {
-                float x1 = positions[currentTri[k]][0];
-                float y1 = positions[currentTri[k]][1];
-                float z1 = positions[currentTri[k]][2];
-
-                if(x1 < minX1)
-                    minX1 = x1;
-                if(y1 < minY1)
-                    minY1 = y1;
-                if(z1 < minZ1)
-                    minZ1 = z1;
-
-                if(x1 > maxX1)
-                    maxX1 = x1;
-                if(y1 > maxY1)
-                    maxY1 = y1;
-                if(z1 > maxZ1)
-                    maxZ1 = z1;
+    const std::vector<Vec3f> &c = barycenters;
+    float cut = meanPos[splt];
+    return partition(begin, end, [&c, splt, cut] (int j) {
+        return c[j][splt] > cut;
+    });
+}
+
+unsigned int BVHBuilder::splitSAH(unsigned int begin, unsigned int end,
+        const NodeBounds &bounds) {
+    const SAHBin &centroids = bounds.centroids;
+    unsigned int n = end - begin;
+
+    if (n <= 1)
+        return begin;
+
+    const std::vector<int> &tri_index = bvh.tri_index;
+    unsigned int binCount = std::max(2u, params.bins);
+    float parentArea = bounds.box.area();
+    if (parentArea <= 0.f)
+        parentArea = 1.f;
+
+    Vec3f scale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroids.upp[axis] - centroids.low[axis];
+        scale[axis] = extent > 0.f ? binCount / extent : 0.f;
+    }
+
+    /* Bins of the three axes, filled chunk by chunk then merged */
+    std::vector<std::vector<SAHBin> > partials =
+        mapChunks<std::vector<SAHBin> >(begin, end,
+            [&] (unsigned int b, unsigned int e) {
+        std::vector<SAHBin> bins(3 * binCount);
+        for (unsigned int i = b; i < e; i++) {
+            int j = tri_index[i];
+            for (int axis = 0; axis < 3; axis++) {
+                unsigned int bin = (unsigned int)
+                    ((barycenters[j][axis] - centroids.low[axis])
+                     * scale[axis]);
+                bin = std::min(bin, binCount - 1);
+                bins[axis*binCount + bin].count ++;
+                bins[axis*binCount + bin].extend(lows[j], upps[j]);
             }
-        } else {
-            child_tri_index_2.push_back(tri_index[i]);
-            meanPos2 += barycenter;
-
-            for(int k = 0; k < 3; k++) {
-                float x2 = positions[currentTri[k]][0];
-                float y2 = positions[currentTri[k]][1];
-                float z2 = positions[currentTri[k]][2];
-
-                if(x2 < minX2)
-                    minX2 = x2;
-                if(y2 < minY2)
-                    minY2 = y2;
-                if(z2 < minZ2)
-                    minZ2 = z2;
-
-                if(x2 > maxX2)
-                    maxX2 = x2;
-                if(y2 > maxY2)
-                    maxY2 = y2;
-                if(z2 > maxZ2)
-                    maxZ2 = z2;
+        }
+        return bins;
+    });
+
+    std::vector<SAHBin> bins(3 * binCount);
+    for (unsigned int c = 0; c < partials.size(); c++) {
+        for (unsigned int b = 0; b < 3 * binCount; b++)
+            bins[b].merge(partials[c][b]);
+    }
+
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    unsigned int bestBin = 0;
+    std::vector<float> rightCost(binCount);
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0.f)
+            continue;
+
+        const SAHBin *axisBins = &bins[axis*binCount];
+
+        /* Sweeping from the right, then from the left: splitting after
+         * bin b puts bins [0, b] in the first child */
+        SAHBin acc;
+        for (unsigned int b = binCount - 1; b > 0; b--) {
+            acc.merge(axisBins[b]);
+            rightCost[b - 1] = acc.area() * acc.count;
+        }
+
+        acc = SAHBin();
+        for (unsigned int b = 0; b < binCount - 1; b++) {
+            acc.merge(axisBins[b]);
+            float cost = params.traversalCost + params.leafCost *
+                (acc.area() * acc.count + rightCost[b]) / parentArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
             }
         }
     }
 
-    meanPos1 *= 1.0/(float) child_tri_index_1.size();
-    meanPos2 *= 1.0/(float) child_tri_index_2.size();
+    /* All barycenters coincide, no binning can separate them */
+    if (bestAxis < 0)
+        return begin;
+
+    if (bestCost >= n * params.leafCost && n <= params.maxLeafSize)
+        return begin;
+
+    const std::vector<Vec3f> &c = barycenters;
+    float low = centroids.low[bestAxis];
+    float axisScale = scale[bestAxis];
+    return partition(begin, end,
+            [&c, bestAxis, bestBin, binCount, low, axisScale] (int j) {
+        unsigned int b = (unsigned int) ((c[j][bestAxis] - low) * axisScale);
+        return std::min(b, binCount - 1) <= bestBin;
+    });
+}
 
-    Vec3f lowPos1 = Vec3f(minX1, minY1, minZ1);
-    Vec3f uppPos1 = Vec3f(maxX1, maxY1, maxZ1);
-    child_box_1 = BoundingBox(lowPos1, uppPos1, meanPos1);
+/* Linear BVH: triangles are sorted along a Morton curve, and the radix
+ * tree of their codes is read off the common prefix lengths of consecutive
+ * codes. The split of any range is at its shortest prefix, so the tree is
+ * the Cartesian tree of these lengths, built in one stack pass. */
+void BVHBuilder::buildLBVH(std::vector<BVHNode> &out) {
+    std::vector<int> &tri_index = bvh.tri_index;
+    unsigned int n = tri_index.size();
+
+    NodeBounds bounds = computeBounds(0, n);
+    std::vector<unsigned int> codes(n);
+    forChunks(0, n, [&] (unsigned int, unsigned int b, unsigned int e) {
+        for (unsigned int i = b; i < e; i++)
+            codes[i] = mortonCode(barycenters[tri_index[i]],
+                    bounds.centroids.low, bounds.centroids.upp);
+    });
+    radixSortMorton(codes, tri_index);
+
+    /* Prefix lengths, duplicated codes being told apart by their rank */
+    MortonTree tree;
+    tree.prefix.resize(n > 1 ? n - 1 : 0);
+    for (unsigned int i = 0; i + 1 < n; i++) {
+        unsigned int diff = codes[i] ^ codes[i + 1];
+        tree.prefix[i] = diff != 0 ? __builtin_clz(diff)
+            : 32 + __builtin_clz(i ^ (i + 1));
+    }
+
+    tree.left.assign(tree.prefix.size(), -1);
+    tree.right.assign(tree.prefix.size(), -1);
+    std::vector<int> stack;
+    for (unsigned int k = 0; k < tree.prefix.size(); k++) {
+        int last = -1;
+        while (!stack.empty() && tree.prefix[stack.back()] > tree.prefix[k]) {
+            last = stack.back();
+            stack.pop_back();
+        }
+        tree.left[k] = last;
+        if (!stack.empty())
+            tree.right[stack.back()] = k;
+        stack.push_back(k);
+    }
+
+    int root = stack.empty() ? -1 : stack[0];
+    emitLBVH(tree, root, 0, n - 1, 0, out);
+}
+
+/* Appends the radix tree node covering triangles [first, last] and returns
+ * its index, collapsing small subtrees into leaves */
+unsigned int BVHBuilder::emitLBVH(const MortonTree &tree, int node,
+        unsigned int first, unsigned int last, unsigned int depth,
+        std::vector<BVHNode> &out) {
+    unsigned int index = out.size();
+    out.push_back(BVHNode());
+
+    /* Past the depth limit the range is only halved until it fits a 16
+     * bits leaf, node being kept as a placeholder for the halves */
+    unsigned int count = last - first + 1;
+    bool capped = depth + leafHalvings(count) >= BVH_STACK_SIZE - 2;
+    if ((node < 0 || count <= LBVH_LEAF_SIZE || capped) && count <= 0xffff) {
+        SAHBin box;
+        for (unsigned int i = first; i <= last; i++) {
+            int j = bvh.tri_index[i];
+            box.extend(lows[j], upps[j]);
+        }
+        for (int k = 0; k < 3; k++) {
+            out[index].low[k] = box.low[k];
+            out[index].upp[k] = box.upp[k];
+        }
+        out[index].offset = first;
+        out[index].count = count;
+        return index;
+    }
+
+    unsigned int split = capped ? first + count / 2 - 1 : node;
+    emitLBVH(tree, capped ? node : tree.left[node], first, split, depth + 1,
+            out);
+    unsigned int second = emitLBVH(tree, capped ? node : tree.right[node],
+            split + 1, last, depth + 1, out);
+
+    const BVHNode &a = out[index + 1];
+    const BVHNode &b = out[second];
+    for (int k = 0; k < 3; k++) {
+        out[index].low[k] = std::min(a.low[k], b.low[k]);
+        out[index].upp[k] = std::max(a.upp[k], b.upp[k]);
+    }
+
+    /* Codes interleave x, y, z bits from bit 29 down, the first differing
+     * bit tells the split axis */
+    unsigned int prefix = capped ? 32 : tree.prefix[node];
+    out[index].offset = second;
+    out[index].count = 0;
+    out[index].axis = prefix < 32 ? (prefix - 2) % 3 : 0;
+    return index;
+}
+
+BVH::BVH() : mesh(NULL) {}
+
+BVH::BVH(const Mesh &_mesh, const BVHParams &params) : mesh(&_mesh) {
+    unsigned int n = mesh->triangles().size();
+
+    tri_index.resize(n);
+    for (unsigned int i = 0; i < n; i++) {
+        tri_index[i] = i;
+    }
+
+    if (n == 0)
+        return;
+
+    /* A binary tree with single triangle leaves is the largest possible */
+    nodes.reserve(2*n - 1);
+    BVHBuilder builder(*this, params);
+    if (params.method == BVHParams::SPLIT_LBVH)
+        builder.buildLBVH(nodes);
+    else
+        builder.build(0, n, 0, nodes);
+    nodes.shrink_to_fit();
+}
+
+BVH::BVH(const Mesh &_mesh, std::vector<BVHNode> &_nodes,
+        std::vector<int> &_tri_index) : mesh(&_mesh) {
+    nodes.swap(_nodes);
+    tri_index.swap(_tri_index);
+}
+
+BoundingBox BVH::nodeBBox(unsigned int node) const {
+    const BVHNode &n = nodes[node];
+    Vec3f low = Vec3f(n.low[0], n.low[1], n.low[2]);
+    Vec3f upp = Vec3f(n.upp[0], n.upp[1], n.upp[2]);
+    return BoundingBox((low + upp) / 2.f, low, upp);
+}
+
+BoundingBox BVH::getBBox() const {
+    if (nodes.empty())
+        return BoundingBox();
+    return nodeBBox(0);
+}
+
+unsigned int BVH::leafCount() const {
+    unsigned int leaves = 0;
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+        if (nodes[i].isLeaf())
+            leaves ++;
+    }
+    return leaves;
+}
+
+float BVH::sahCost(float traversalCost, float leafCost) const {
+    if (nodes.empty())
+        return 0.f;
+    return sahCost(0, traversalCost, leafCost);
+}
+
+static float nodeArea(const BVHNode &node) {
+    float dx = node.upp[0] - node.low[0];
+    float dy = node.upp[1] - node.low[1];
+    float dz = node.upp[2] - node.low[2];
+    return 2.f * (dx*dy + dy*dz + dz*dx);
+}
+
+float BVH::sahCost(unsigned int node, float traversalCost,
+        float leafCost) const {
+    const BVHNode &n = nodes[node];
+    if (n.isLeaf())
+        return leafCost * n.count;
+
+    unsigned int left = node + 1;
+    unsigned int right = n.offset;
+    float area = nodeArea(n);
+    if (area <= 0.f)
+        return traversalCost + sahCost(left, traversalCost, leafCost)
+            + sahCost(right, traversalCost, leafCost);
+
+    return traversalCost
+        + nodeArea(nodes[left]) / area
+            * sahCost(left, traversalCost, leafCost)
+        + nodeArea(nodes[right]) / area
+            * sahCost(right, traversalCost, leafCost);
+}
+
+void BVH::draw(std::vector<float> &colors) const {
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+        if (nodes[i].isLeaf())
+            nodeBBox(i).draw(mesh, colors, &tri_index[nodes[i].offset],
+                    nodes[i].count);
+    }
+}
+
+bool BVH::occluded(const Ray &ray, int ignoredVertex) const {
+    if (nodes.empty())
+        return false;
+
+    const MeshArray<Vec3f> &positions = mesh->positions();
+    const MeshArray<Triangle> &triangles = mesh->triangles();
+    float tmax = ray.getTMax();
+
+    /* Depth-first traversal, stopping at the first blocking triangle */
+    unsigned int stack[BVH_STACK_SIZE];
+    unsigned int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const BVHNode &node = nodes[stack[--stackSize]];
+
+        float tNear;
+        if (!node.rayInter(ray, tmax, tNear))
+            continue;
+
+        if (!node.isLeaf()) {
+            stack[stackSize++] = node.offset;
+            stack[stackSize++] = &node - &nodes[0] + 1;
+            continue;
+        }
+
+        for (unsigned int i = node.offset; i < node.offset + node.count;
+                i++) {
+            const Triangle &tri = triangles[tri_index[i]];
+            if (ignoredVertex >= 0 && tri.contains(ignoredVertex))
+                continue;
+
+            if (ray.rayTriangleInter(positions[tri[0]], positions[tri[1]],
+                        positions[tri[2]]))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+unsigned int BVH::occluded(const RayPacket &packet) const {
+    if (nodes.empty() || packet.size == 0)
+        return 0;
+
+    const MeshArray<Vec3f> &positions = mesh->positions();
+    const MeshArray<Triangle> &triangles = mesh->triangles();
+
+    unsigned int alive = packet.fullMask();
+
+    /* One stack for the whole packet: a node is fetched once for all the
+     * rays still unblocked, and visited if any of them enters it */
+    unsigned int stack[BVH_STACK_SIZE];
+    unsigned int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0 && alive) {
+        const BVHNode &node = nodes[stack[--stackSize]];
+
+        /* Padded as the huge reciprocals of the packet would miss a box
+         * that a ray runs along */
+        float low[3], upp[3];
+        for (int k = 0; k < 3; k++) {
+            float pad = 1e-6f * (std::fabs(node.low[k]) +
+                                 std::fabs(node.upp[k])) + 1e-9f;
+            low[k] = node.low[k] - pad;
+            upp[k] = node.upp[k] + pad;
+        }
+
+        /* Interval culling first, for all the rays at once, then the
+         * slab test of each ray */
+        if (packet.missesBox(low, upp))
+            continue;
+        unsigned int active = packet.hitBox(low, upp, alive);
+        if (!active)
+            continue;
+
+        if (!node.isLeaf()) {
+            /* Near child first, along the direction of the packet */
+            unsigned int left = &node - &nodes[0] + 1;
+            float direction[3] = {packet.dx[0], packet.dy[0], packet.dz[0]};
+            if (direction[node.axis] < 0.f) {
+                stack[stackSize++] = left;
+                stack[stackSize++] = node.offset;
+            } else {
+                stack[stackSize++] = node.offset;
+                stack[stackSize++] = left;
+            }
+            continue;
+        }
+
+        for (unsigned int i = node.offset;
+                i < node.offset + node.count && active; i++) {
+            const Triangle &tri = triangles[tri_index[i]];
+            unsigned int blocked = packet.hitTriangle(positions[tri[0]],
+                    positions[tri[1]], positions[tri[2]],
+                    tri[0], tri[1], tri[2], active);
+            active &= ~blocked;
+            alive &= ~blocked;
+        }
+    }
+
+    return packet.fullMask() & ~alive;
+}
+
+bool BVH::intersect(const Ray &ray, Hit &hit, int ignoredVertex) const {
+    if (nodes.empty())
+        return false;
+
+    const MeshArray<Vec3f> &positions = mesh->positions();
+    const MeshArray<Triangle> &triangles = mesh->triangles();
+
+    /* The ray is clipped to the closest hit found so far */
+    float tmax = std::min(hit.t, ray.getTMax());
+
+    float tNear;
+    if (!nodes[0].rayInter(ray, tmax, tNear))
+        return false;
+
+    /* Nodes are stacked with their entry distance, so the ones lying
+     * beyond the closest hit found so far can be skipped when popped */
+    unsigned int stack[BVH_STACK_SIZE];
+    float stackNear[BVH_STACK_SIZE];
+    unsigned int stackSize = 0;
+    stack[stackSize] = 0;
+    stackNear[stackSize++] = tNear;
+    bool found = false;
+
+    while (stackSize > 0) {
+        stackSize--;
+        unsigned int index = stack[stackSize];
+        if (stackNear[stackSize] > tmax)
+            continue;
+
+        const BVHNode &node = nodes[index];
+
+        if (!node.isLeaf()) {
+            unsigned int left = index + 1;
+            unsigned int right = node.offset;
+            float tLeft, tRight;
+            bool hitLeft = nodes[left].rayInter(ray, tmax, tLeft);
+            bool hitRight = nodes[right].rayInter(ray, tmax, tRight);
+
+            /* Front-to-back: the nearest child is pushed last */
+            if (hitLeft && hitRight && tRight < tLeft) {
+                std::swap(left, right);
+                std::swap(tLeft, tRight);
+            }
+            if (hitRight) {
+                stack[stackSize] = right;
+                stackNear[stackSize++] = tRight;
+            }
+            if (hitLeft) {
+                stack[stackSize] = left;
+                stackNear[stackSize++] = tLeft;
+            }
+            continue;
+        }
+
+        for (unsigned int i = node.offset; i < node.offset + node.count;
+                i++) {
+            const Triangle &tri = triangles[tri_index[i]];
+            if (ignoredVertex >= 0 && tri.contains(ignoredVertex))
+                continue;
+
+            float t, u, v;
+            if (ray.rayTriangleInter(positions[tri[0]], positions[tri[1]],
+                        positions[tri[2]], t, u, v) && t < tmax) {
+                tmax = t;
+                hit.t = t;
+                hit.triangle = tri_index[i];
+                hit.u = u;
+                hit.v = v;
+                found = true;
+            }
+        }
+    }
 
-    Vec3f lowPos2 = Vec3f(minX2, minY2, minZ2);
-    Vec3f uppPos2 = Vec3f(maxX2, maxY2, maxZ2);
-    child_box_2 = BoundingBox(lowPos2, uppPos2, meanPos2);
+    return found;
 }
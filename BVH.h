@@ -5,46 +5,130 @@
 #include "Vec3.h"
 #include "Mesh.h"
 #include "BoundingBox.h"
+#include "Ray.h"
+#include "RayPacket.h"
+
+/* Build settings. SAH costs are expressed relative to one node traversal. */
+struct BVHParams {
+    enum SplitMethod {
+        SPLIT_MEAN, // Longest axis, cut at the mean barycenter
+        SPLIT_SAH,  // Binned surface area heuristic
+        SPLIT_LBVH  // Morton codes sorted in linear time, fastest build
+    };
+
+    SplitMethod method;
+    unsigned int bins;
+    float traversalCost;
+    float leafCost;           // Cost of one triangle test in a leaf
+    unsigned int maxLeafSize; // Leaves are split past this size anyway
+
+    /* Subtrees over at least this many triangles are built on the thread
+     * pool, 0 builds on the calling thread only. Both give the same tree. */
+    unsigned int parallelThreshold;
+
+    BVHParams(SplitMethod _method = SPLIT_SAH) : method(_method), bins(16),
+        traversalCost(1.f), leafCost(1.f), maxLeafSize(16),
+        parallelThreshold(16384) {}
+};
+
+/* A 32 bytes node of the flattened tree. Nodes are stored depth-first, so
+ * the first child of an interior node is the next node in the array and
+ * only the second one needs an index. */
+struct BVHNode {
+    float low[3];
+    float upp[3];
+    unsigned int offset;  // Leaf: first entry in the index array
+                          // Interior: index of the second child
+    unsigned short count; // Number of triangles, 0 for interior nodes
+    unsigned char axis;   // Split axis of interior nodes
+    unsigned char pad;
+
+    bool isLeaf() const {return count > 0;}
+
+    /* Slab test over the range [ray tmin, tmax], giving the entry distance.
+     * The signs of the direction pick the near and far planes. A ray
+     * starting on the face of an axis it runs parallel to gets a NaN
+     * distance there, which the comparisons ignore. */
+    bool rayInter(const Ray &ray, float tmax, float &tNear) const {
+        const Vec3f &origin = ray.getOrigin();
+        const Vec3f &invDir = ray.getInvDirection();
+        tNear = ray.getTMin();
+        float tFar = tmax;
+
+        for (int k = 0; k < 3; k++) {
+            int sign = ray.getSign(k);
+            float t0 = ((sign ? upp[k] : low[k]) - origin[k]) * invDir[k];
+            float t1 = ((sign ? low[k] : upp[k]) - origin[k]) * invDir[k];
+            if (t0 > tNear)
+                tNear = t0;
+            if (t1 < tFar)
+                tFar = t1;
+            if (tNear > tFar)
+                return false;
+        }
+
+        return true;
+    }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes");
+
+/* Traversal stacks are fixed arrays, the builder never goes deeper */
+#define BVH_STACK_SIZE 128
 
 class BVH {
+    friend class BVHBuilder;
+
     private :
         const Mesh * mesh;
 
+        /* Nodes in depth-first order, and the triangle indices reordered so
+         * that each leaf covers a contiguous range */
+        std::vector<BVHNode> nodes;
         std::vector<int> tri_index;
-        BoundingBox bBox;
-        BVH * leftChild;
-        BVH * rightChild;
 
-        /* Stopping criteria */
+        /* Stopping criteria of the mean split */
         static unsigned int max_density;
-        static unsigned int nodes;
-        static unsigned int leaves;
 
-        void split(std::vector<int> &_child_tri_index_1,
-                   std::vector<int> &_child_tri_index_2,
-                   BoundingBox &child_box_1, BoundingBox &child_box_2);
+        float sahCost(unsigned int node, float traversalCost,
+                      float leafCost) const;
 
     public :
-        ~BVH() {};
+        ~BVH() {}
         /* Constructors */
         BVH();
-        BVH(const Mesh &mesh);
-        BVH(const Mesh &mesh, const std::vector<int> &tri_index,
-                const BoundingBox &_bBox);
+        BVH(const Mesh &mesh, const BVHParams &params = BVHParams());
+        /* Takes over the arrays of a tree built before, such as one read
+         * from a MeshCache, leaving them empty */
+        BVH(const Mesh &mesh, std::vector<BVHNode> &_nodes,
+            std::vector<int> &_tri_index);
 
         /* Getters */
-        const BVH*  getLeftChild() {return leftChild;}
-        const BVH*  getRightChild() {return rightChild;}
-        const BoundingBox getBBox() {return bBox;}
-        const std::vector<int> getIndexes() const {return tri_index;}
+        const std::vector<BVHNode> & getNodes() const {return nodes;}
+        const std::vector<int> & getIndexes() const {return tri_index;}
         const Mesh* getMesh() const {return mesh;}
+        BoundingBox getBBox() const;
+        BoundingBox nodeBBox(unsigned int node) const;
+        unsigned int leafCount() const;
 
-        const void draw(std::vector<float> &colors) {
-            if (leftChild != NULL)
-                leftChild->draw(colors);
-            if (rightChild != NULL)
-                rightChild->draw(colors);
-            if (leftChild == NULL && rightChild == NULL)
-                bBox.draw(mesh, colors, tri_index);
-        }
+        /* Expected cost of tracing a ray through the tree, following the
+         * surface area heuristic. Lower is better. */
+        float sahCost(float traversalCost = 1.f, float leafCost = 1.f) const;
+
+        /* Returns true if a triangle blocks the ray within its segment.
+         * Triangles sharing ignoredVertex are skipped, as the ray starts
+         * on them. */
+        bool occluded(const Ray &ray, int ignoredVertex = -1) const;
+
+        /* Occlusion of a whole packet, sharing one traversal between its
+         * rays. Returns the mask of the blocked lanes. */
+        unsigned int occluded(const RayPacket &packet) const;
+
+        /* Finds the closest triangle hit by the ray within its segment and
+         * before hit.t, and fills hit with its distance, index and
+         * barycentrics. */
+        bool intersect(const Ray &ray, Hit &hit,
+                       int ignoredVertex = -1) const;
+
+        void draw(std::vector<float> &colors) const;
 };
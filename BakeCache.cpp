@@ -0,0 +1,201 @@
+#include "BakeCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "Random.h"
+
+#define BAKE_CACHE_MAGIC "IGRBAKE"
+#define BAKE_CACHE_VERSION 3
+
+/* Layout of the file: the header, then its sections one after the other */
+struct BakeCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertexCount;
+    uint64_t meshHash;
+    uint32_t sectionCount;
+    uint32_t padding;
+};
+
+struct BakeCacheSection {
+    uint32_t type;
+    uint32_t padding;
+    uint64_t key;
+    uint64_t size; // Bytes of data following
+};
+
+/* Hashes the bytes into h, a word at a time */
+static uint64_t hashBytes(uint64_t h, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, std::min<size_t>(8, size - i));
+        h = splitMix64(h ^ word) + i;
+    }
+    return splitMix64(h ^ size);
+}
+
+template <typename T>
+static uint64_t hashValue(uint64_t h, const T &value) {
+    return hashBytes(h, &value, sizeof(T));
+}
+
+void BakeCache::open(const std::string &modelFilename, const Mesh &mesh) {
+    filename = modelFilename + ".bake";
+    vertexCount = mesh.positions().size();
+
+    const MeshArray<Vec3f> &positions = mesh.positions();
+    const MeshArray<Triangle> &triangles = mesh.triangles();
+    meshHash = hashBytes(0, positions.data(),
+            positions.size() * sizeof(Vec3f));
+    meshHash = hashBytes(meshHash, triangles.data(),
+            triangles.size() * sizeof(Triangle));
+    setNormals(mesh.normals());
+
+    for (int s = 0; s < SECTION_COUNT; s++)
+        sections[s] = Section();
+    read();
+}
+
+void BakeCache::setNormals(const MeshArray<Vec3f> &normals) {
+    normalHash = hashBytes(0, normals.data(), normals.size() * sizeof(Vec3f));
+}
+
+uint64_t BakeCache::aoKey(int samples, float radius, int sequence,
+        uint64_t seed) const {
+    uint64_t h = hashValue(meshHash, (uint32_t) SECTION_AO);
+    h = hashValue(h, normalHash);
+    h = hashValue(h, samples);
+    h = hashValue(h, radius);
+    h = hashValue(h, sequence);
+    return hashValue(h, seed);
+}
+
+uint64_t BakeCache::shadowKey(const Vec3f &lightPos, int lightShape,
+        float lightSize, int samples) const {
+    uint64_t h = hashValue(meshHash, (uint32_t) SECTION_SHADOWS);
+    for (int k = 0; k < 3; k++)
+        h = hashValue(h, lightPos[k]);
+    h = hashValue(h, lightShape);
+    h = hashValue(h, lightSize);
+    return hashValue(h, samples);
+}
+
+template <typename T>
+bool BakeCache::load(SectionType type, uint64_t key,
+        std::vector<T> &values) const {
+    const Section &section = sections[type];
+    if (section.data.empty() || section.key != key
+            || section.data.size() != vertexCount * sizeof(T))
+        return false;
+
+    values.resize(vertexCount);
+    memcpy((void *) values.data(), section.data.data(), section.data.size());
+    return true;
+}
+
+template <typename T>
+void BakeCache::setSection(SectionType type, uint64_t key,
+        const std::vector<T> &values) {
+    Section &section = sections[type];
+    section.key = key;
+    section.data.resize(values.size() * sizeof(T));
+    if (!values.empty())
+        memcpy(section.data.data(), values.data(), section.data.size());
+}
+
+bool BakeCache::loadAO(uint64_t key, std::vector<float> &ao,
+        std::vector<Vec3f> &bentNormals) const {
+    return load(SECTION_AO, key, ao)
+        && load(SECTION_BENT_NORMALS, key, bentNormals);
+}
+
+bool BakeCache::loadShadows(uint64_t key,
+        std::vector<float> &visibility) const {
+    return load(SECTION_SHADOWS, key, visibility);
+}
+
+void BakeCache::saveAO(uint64_t key, const std::vector<float> &ao,
+        const std::vector<Vec3f> &bentNormals) {
+    setSection(SECTION_AO, key, ao);
+    setSection(SECTION_BENT_NORMALS, key, bentNormals);
+    write();
+}
+
+void BakeCache::saveShadows(uint64_t key,
+        const std::vector<float> &visibility) {
+    setSection(SECTION_SHADOWS, key, visibility);
+    write();
+}
+
+void BakeCache::read() {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in)
+        return;
+
+    BakeCacheHeader header;
+    if (!in.read((char *) &header, sizeof(header))
+            || memcmp(header.magic, BAKE_CACHE_MAGIC, 8) != 0
+            || header.version != BAKE_CACHE_VERSION
+            || header.vertexCount != vertexCount
+            || header.meshHash != meshHash)
+        return;
+
+    for (uint32_t s = 0; s < header.sectionCount; s++) {
+        BakeCacheSection entry;
+        if (!in.read((char *) &entry, sizeof(entry))
+                || entry.size > (uint64_t) vertexCount * sizeof(Vec3f))
+            break;
+
+        Section section;
+        section.key = entry.key;
+        section.data.resize(entry.size);
+        if (entry.size > 0 && !in.read(&section.data[0], entry.size))
+            break;
+        if (entry.type < SECTION_COUNT)
+            sections[entry.type] = section;
+    }
+}
+
+void BakeCache::write() const {
+    if (filename.empty())
+        return;
+
+    BakeCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BAKE_CACHE_MAGIC, 8);
+    header.version = BAKE_CACHE_VERSION;
+    header.vertexCount = vertexCount;
+    header.meshHash = meshHash;
+    for (int s = 0; s < SECTION_COUNT; s++)
+        header.sectionCount += !sections[s].data.empty();
+
+    /* Written aside then renamed, so that an interrupted write never
+     * leaves a truncated cache behind */
+    std::string partial = filename + ".part";
+    std::ofstream out(partial.c_str(), std::ios::binary);
+    out.write((const char *) &header, sizeof(header));
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        if (sections[s].data.empty())
+            continue;
+
+        BakeCacheSection entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = s;
+        entry.key = sections[s].key;
+        entry.size = sections[s].data.size();
+        out.write((const char *) &entry, sizeof(entry));
+        out.write(&sections[s].data[0], entry.size);
+    }
+    out.close();
+
+    if (!out || rename(partial.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Could not write the bake cache " << filename
+            << std::endl;
+        remove(partial.c_str());
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Vec3.h"
+#include "Mesh.h"
+
+/* Per-vertex bake results saved next to the model, in <model>.bake. The
+ * file holds one section per kind of result, each tagged with a key
+ * hashing the mesh, its normals for the AO, and the parameters it was
+ * baked with, so that stale results are never loaded. Values are stored
+ * in the byte order of the machine. A missing or broken cache only means
+ * baking again. */
+class BakeCache {
+    public :
+        BakeCache() : meshHash(0), normalHash(0), vertexCount(0) {}
+
+        /* Binds the cache to the model and reads its file, if any */
+        void open(const std::string &modelFilename, const Mesh &mesh);
+
+        /* Keys the AO to these normals, around which its samples are
+         * drawn. open() takes the ones of the mesh, call it again when
+         * they are recomputed. */
+        void setNormals(const MeshArray<Vec3f> &normals);
+
+        /* Keys of the results baked with the given parameters */
+        uint64_t aoKey(int samples, float radius, int sequence,
+                       uint64_t seed) const;
+        uint64_t shadowKey(const Vec3f &lightPos, int lightShape,
+                           float lightSize, int samples) const;
+
+        /* Fill the per-vertex results if the cache holds them for the key.
+         * The AO comes with the bent normals traced by the same rays. */
+        bool loadAO(uint64_t key, std::vector<float> &ao,
+                    std::vector<Vec3f> &bentNormals) const;
+        bool loadShadows(uint64_t key, std::vector<float> &visibility) const;
+
+        /* Replace the results of the same kind, and rewrite the file */
+        void saveAO(uint64_t key, const std::vector<float> &ao,
+                    const std::vector<Vec3f> &bentNormals);
+        void saveShadows(uint64_t key, const std::vector<float> &visibility);
+
+    private :
+        enum SectionType {
+            SECTION_AO,      // One float per vertex
+            SECTION_SHADOWS, // One float per vertex, the visible part of the light
+            SECTION_BENT_NORMALS, // One Vec3f per vertex, under the key of the AO
+            SECTION_COUNT
+        };
+
+        struct Section {
+            uint64_t key;
+            std::vector<char> data; // Empty if nothing is cached
+
+            Section() : key(0) {}
+        };
+
+        std::string filename;
+        uint64_t meshHash;   // Positions and triangles
+        uint64_t normalHash;
+        uint32_t vertexCount;
+        Section sections[SECTION_COUNT];
+
+        template <typename T>
+        bool load(SectionType type, uint64_t key,
+                  std::vector<T> &values) const;
+        template <typename T>
+        void setSection(SectionType type, uint64_t key,
+                        const std::vector<T> &values);
+        void read();
+        void write() const;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Vec3.h"
+#include "Mesh.h"
 
 class BoundingBox {
     public:
@@ -22,18 +23,22 @@ class BoundingBox {
             meanPos(_meanPos), lowCorner(_lowCorner), uppCorner(_uppCorner),
             color(Vec3f(0.0,0.0,0.0)) {}
 
-        const void draw (const Mesh * &mesh, std::vector<float> &colors,
-                         std::vector<int> &tri_index) {
-            std::vector<Triangle> triangles = mesh->triangles();
-            std::vector<Vec3f> positions = mesh->positions();
+        float area() const {
+            Vec3f d = uppCorner - lowCorner;
+            return 2.f * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+        }
+
+        void draw (const Mesh * mesh, std::vector<float> &colors,
+                   const int * tri_index, unsigned int count) const {
+            const MeshArray<Triangle> &triangles = mesh->triangles();
 
-            Vec3f randColor = Vec3f(rand()%255/255,
-                                    rand()%255/255,
-                                    rand()%255/255);
+            Vec3f randColor = Vec3f(rand()%255/255.f,
+                                    rand()%255/255.f,
+                                    rand()%255/255.f);
 
-            for (unsigned int i = 0; i< tri_index.size(); i++) {
+            for (unsigned int i = 0; i < count; i++) {
                 int j = tri_index[i];
-                Triangle currentTri = triangles[j];
+                const Triangle &currentTri = triangles[j];
 
                 colors[4*currentTri[0]    ] = randColor[0];
                 colors[4*currentTri[0] + 1] = randColor[1];
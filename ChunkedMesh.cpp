@@ -0,0 +1,549 @@
+#include "ChunkedMesh.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <exception>
+#include <fstream>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#include "Exception.h"
+#include "MeshCache.h"
+#include "Morton.h"
+#include "TextScanner.h"
+#include "ThreadPool.h"
+
+#define CHUNKED_MAGIC "IGRCHNK"
+#define CHUNKED_VERSION 2
+#define CHUNK_BYTES_PER_VERTEX 512 // Rough size of a resident chunk, per vertex of its cell
+#define RESIDENT_CHUNKS 16 // Chunks the memory budget holds at least
+#define CHUNK_MIN_VERTICES 4096 // Smallest target size of a chunk
+#define CHUNK_GRID_MAX 256 // Cells along each axis of the grid, at most
+#define CHUNK_MARGIN 1e-4f // Added to the chunk bounds, so that rays along their faces enter them
+#define TRIANGLE_BUFFER 65536 // Triangles written at once while streaming the faces
+
+/* Layout of the index file: the header, then one MeshChunk per chunk */
+struct ChunkIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunkCount;
+    uint64_t modelSize;
+    int64_t modelTime;
+    uint32_t vertexCount;
+    uint32_t gridSize;
+};
+
+int ResidentChunk::localVertex(uint32_t vertex) const {
+    std::vector<uint32_t>::const_iterator it = std::lower_bound(
+            vertexIds.begin(), vertexIds.end(), vertex);
+    if (it == vertexIds.end() || *it != vertex)
+        return -1;
+    return it - vertexIds.begin();
+}
+
+std::string ChunkedMesh::filePath(const std::string &name) const {
+    return directory + "/" + name;
+}
+
+void ChunkedMesh::open(const std::string &_modelFilename) {
+    modelFilename = _modelFilename;
+    directory = modelFilename + ".chunks";
+    if (!MappedFile::stamp(modelFilename, modelSize, modelTime))
+        throw Exception("Cannot read " + modelFilename);
+
+    if (!openChunks()) {
+        build();
+        if (!openChunks())
+            throw Exception("Cannot read the chunks of " + modelFilename);
+    }
+
+    /* The chunks follow a Morton curve over the grid, so that halving
+     * their range gives nearby chunks */
+    tracedChunks.clear();
+    for (unsigned int c = 0; c < chunks.size(); c++)
+        if (chunks[c].triangleCount > 0)
+            tracedChunks.push_back(c);
+    tree.clear();
+    chunkLeaves.assign(chunks.size(), 0);
+    if (!tracedChunks.empty())
+        buildTree(0, tracedChunks.size());
+
+    residentMemory = 0;
+    recentChunks.clear();
+    resident.assign(chunks.size(), std::shared_ptr<const ResidentChunk>());
+    recentPosition.resize(chunks.size());
+}
+
+/* Maps the files of the directory if they are complete and come from the
+ * model as it is */
+bool ChunkedMesh::openChunks() {
+    std::unique_ptr<MappedFile> index;
+    try {
+        index.reset(new MappedFile(filePath("index")));
+    } catch (Exception &) {
+        return false;
+    }
+
+    ChunkIndexHeader header;
+    if (index->getSize() < sizeof(header))
+        return false;
+    memcpy(&header, index->begin(), sizeof(header));
+    if (memcmp(header.magic, CHUNKED_MAGIC, 8) != 0
+            || header.version != CHUNKED_VERSION
+            || header.modelSize != modelSize
+            || header.modelTime != modelTime
+            || header.gridSize != gridSizeFor(header.vertexCount)
+            || index->getSize() != sizeof(header)
+                + (uint64_t) header.chunkCount * sizeof(MeshChunk))
+        return false;
+
+    try {
+        /* Chunks read their own pieces of these, in any order */
+        positionFile.reset(new MappedFile(filePath("positions"),
+                MappedFile::ACCESS_RANDOM));
+        normalFile.reset(new MappedFile(filePath("normals"),
+                MappedFile::ACCESS_RANDOM));
+        orderFile.reset(new MappedFile(filePath("vertices"),
+                MappedFile::ACCESS_RANDOM));
+    } catch (Exception &) {
+        return false;
+    }
+    vertexCount = header.vertexCount;
+    if (positionFile->getSize() != (uint64_t) vertexCount * sizeof(Vec3f)
+            || normalFile->getSize() != (uint64_t) vertexCount * sizeof(Vec3f)
+            || orderFile->getSize() != (uint64_t) vertexCount
+                * sizeof(uint32_t))
+        return false;
+
+    /* Chunks must cover the vertex order, one after the other */
+    chunks.resize(header.chunkCount);
+    memcpy((void *) chunks.data(), index->begin() + sizeof(header),
+            chunks.size() * sizeof(MeshChunk));
+    uint64_t vertices = 0;
+    for (unsigned int c = 0; c < chunks.size(); c++) {
+        if (chunks[c].firstVertex != vertices)
+            return false;
+        vertices += chunks[c].vertexCount;
+    }
+    return vertices == vertexCount;
+}
+
+/* Cuts the model into the directory, the index last, so that an
+ * interrupted build leaves no valid index behind */
+void ChunkedMesh::build() {
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+        throw Exception("Cannot create " + directory + ": "
+                        + strerror(errno));
+    remove(filePath("index").c_str());
+    removeChunkFiles();
+
+    unsigned int sizeV;
+    uint64_t sizeT;
+    streamOFF(sizeV, sizeT);
+    computeNormals(sizeV, sizeT);
+    cut(sizeT);
+    remove(filePath("triangles").c_str());
+}
+
+/* Removes the chunk files of an earlier cut, which may have had more
+ * chunks than the next one, or chunks that are now empty */
+void ChunkedMesh::removeChunkFiles() {
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL)
+        throw Exception("Cannot read " + directory + ": " + strerror(errno));
+    std::vector<std::string> stale;
+    for (struct dirent *entry = readdir(dir); entry != NULL;
+            entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 5, "chunk") == 0 && name.size() > 10
+                && name.compare(name.size() - 5, 5, ".mesh") == 0)
+            stale.push_back(name);
+    }
+    closedir(dir);
+    for (unsigned int i = 0; i < stale.size(); i++)
+        remove(filePath(stale[i]).c_str());
+}
+
+/* Reads the OFF file as Mesh::loadOFF does, straight into the position
+ * file and, triangle by triangle, into the triangle file. The positions
+ * are then centered and scaled to the unit sphere in place, with the same
+ * arithmetic as Mesh::centerAndScaleToUnit. */
+void ChunkedMesh::streamOFF(unsigned int &sizeV, uint64_t &sizeT) {
+    MappedFile file(modelFilename);
+    TextScanner in(file.begin(), file.end(), modelFilename);
+    bool vertexFields = Mesh::readOFFHeader(in);
+    sizeV = in.readUInt();
+    unsigned int faces = in.readUInt();
+    in.readUInt(); // Edges, unused
+    if (sizeV == 0)
+        in.error("no vertex");
+
+    vertexCount = sizeV;
+    positionFile.reset(new MappedFile(filePath("positions"),
+            (size_t) sizeV * sizeof(Vec3f), MappedFile::ACCESS_RANDOM));
+    Vec3f *positions = (Vec3f *) positionFile->writableBegin();
+    Vec3f c;
+    for (unsigned int i = 0; i < sizeV; i++) {
+        for (unsigned int k = 0; k < 3; k++)
+            positions[i][k] = in.readFloat();
+        if (vertexFields)
+            in.skipLine(); // Colors, normals or texture coordinates
+        c += positions[i];
+    }
+
+    /* Polygons are split in fans, as by Mesh::loadOFF */
+    std::string path = filePath("triangles");
+    std::ofstream out(path.c_str(), std::ios::binary);
+    std::vector<Triangle> buffer;
+    buffer.reserve(TRIANGLE_BUFFER);
+    sizeT = 0;
+    for (unsigned int i = 0; i < faces; i++) {
+        unsigned int n = in.readUInt();
+        if (n < 3)
+            in.error("face with less than 3 vertices");
+        unsigned int v[3];
+        for (unsigned int j = 0; j < n; j++) {
+            v[std::min(j, 2u)] = in.readUInt();
+            if (v[std::min(j, 2u)] >= sizeV)
+                in.error("vertex index out of range");
+            if (j >= 2) {
+                buffer.push_back(Triangle(v[0], v[1], v[2]));
+                v[1] = v[2];
+            }
+        }
+        in.skipLine();
+        if (buffer.size() >= TRIANGLE_BUFFER || i + 1 == faces) {
+            out.write((const char *) buffer.data(),
+                      buffer.size() * sizeof(Triangle));
+            sizeT += buffer.size();
+            buffer.clear();
+        }
+    }
+    out.close();
+    if (!out)
+        throw Exception("Cannot write " + path);
+    if (sizeT > 0xffffffffu)
+        throw Exception("Too many triangles in " + modelFilename);
+
+    c /= sizeV;
+    float maxD = dist(positions[0], c);
+    for (unsigned int i = 0; i < sizeV; i++) {
+        float m = dist(positions[i], c);
+        if (m > maxD)
+            maxD = m;
+    }
+    for (unsigned int i = 0; i < sizeV; i++)
+        positions[i] = (positions[i] - c) / maxD;
+}
+
+/* Same sums, in the same order, as Mesh::recomputeNormals */
+void ChunkedMesh::computeNormals(unsigned int sizeV, uint64_t sizeT) {
+    MappedFile triangleFile(filePath("triangles"));
+    const Triangle *triangles = (const Triangle *) triangleFile.begin();
+    const Vec3f *positions = (const Vec3f *) positionFile->begin();
+    remove(filePath("normals").c_str()); // Sums start from zeros
+    normalFile.reset(new MappedFile(filePath("normals"),
+            (size_t) sizeV * sizeof(Vec3f), MappedFile::ACCESS_RANDOM));
+    Vec3f *normals = (Vec3f *) normalFile->writableBegin();
+
+    for (uint64_t i = 0; i < sizeT; i++) {
+        Vec3f e01 = positions[triangles[i][1]] - positions[triangles[i][0]];
+        Vec3f e02 = positions[triangles[i][2]] - positions[triangles[i][0]];
+        Vec3f n = cross(e01, e02);
+        n.normalize();
+        for (unsigned int j = 0; j < 3; j++)
+            normals[triangles[i][j]] += n;
+    }
+    for (unsigned int i = 0; i < sizeV; i++)
+        normals[i].normalize();
+}
+
+/* Cells along each axis of the grid cutting the model for the budget.
+ * Surfaces cross about gridSize^2 of the cells. */
+unsigned int ChunkedMesh::gridSizeFor(unsigned int vertices) const {
+    size_t target = std::max<size_t>(CHUNK_MIN_VERTICES,
+            memoryBudget / (RESIDENT_CHUNKS * CHUNK_BYTES_PER_VERTEX));
+    unsigned int gridSize = (unsigned int) std::ceil(
+            std::sqrt(vertices / (double) target));
+    return std::min(std::max(gridSize, 1u), (unsigned int) CHUNK_GRID_MAX);
+}
+
+/* Groups the vertices by cell of a grid over the unit sphere, sized so
+ * that a cell holds about what the budget allows a chunk, then writes the
+ * chunks, in the Morton order of their cells, and the index */
+void ChunkedMesh::cut(uint64_t sizeT) {
+    const Vec3f *positions = (const Vec3f *) positionFile->begin();
+    unsigned int gridSize = gridSizeFor(vertexCount);
+    auto cellCode = [&](const Vec3f &p) {
+        unsigned int code = 0;
+        for (int k = 0; k < 3; k++) {
+            float x = (p[k] + 1.f) * 0.5f * gridSize;
+            unsigned int q = (unsigned int) std::min(std::max(x, 0.f),
+                                                     gridSize - 1.f);
+            code |= expandBits(q) << (2 - k);
+        }
+        return code;
+    };
+
+    std::unordered_map<unsigned int, unsigned int> cellSizes;
+    for (unsigned int i = 0; i < vertexCount; i++)
+        cellSizes[cellCode(positions[i])]++;
+    std::vector<unsigned int> codes;
+    for (auto &cell : cellSizes)
+        codes.push_back(cell.first);
+    std::sort(codes.begin(), codes.end());
+    auto chunkOf = [&](unsigned int vertex) {
+        return std::lower_bound(codes.begin(), codes.end(),
+                cellCode(positions[vertex])) - codes.begin();
+    };
+
+    /* Vertices, then triangles, are sorted by chunk, in increasing order
+     * within each of them */
+    chunks.assign(codes.size(), MeshChunk());
+    uint32_t vertices = 0;
+    for (unsigned int c = 0; c < chunks.size(); c++) {
+        chunks[c].firstVertex = vertices;
+        chunks[c].vertexCount = cellSizes[codes[c]];
+        vertices += chunks[c].vertexCount;
+    }
+    orderFile.reset(new MappedFile(filePath("vertices"),
+            (size_t) vertexCount * sizeof(uint32_t),
+            MappedFile::ACCESS_RANDOM));
+    uint32_t *order = (uint32_t *) orderFile->writableBegin();
+    std::vector<uint32_t> cursors(chunks.size());
+    for (unsigned int c = 0; c < chunks.size(); c++)
+        cursors[c] = chunks[c].firstVertex;
+    for (unsigned int i = 0; i < vertexCount; i++)
+        order[cursors[chunkOf(i)]++] = i;
+
+    MappedFile triangleFile(filePath("triangles"));
+    const Triangle *triangles = (const Triangle *) triangleFile.begin();
+    for (uint64_t t = 0; t < sizeT; t++)
+        chunks[chunkOf(triangles[t][0])].triangleCount++;
+    std::vector<uint64_t> firstTriangles(chunks.size());
+    uint64_t sum = 0;
+    for (unsigned int c = 0; c < chunks.size(); c++) {
+        firstTriangles[c] = sum;
+        sum += chunks[c].triangleCount;
+    }
+    std::string orderPath = filePath("triangle-order");
+    {
+        MappedFile triangleOrderFile(orderPath,
+                (size_t) sizeT * sizeof(uint32_t), MappedFile::ACCESS_RANDOM);
+        uint32_t *triangleOrder =
+            (uint32_t *) triangleOrderFile.writableBegin();
+        std::vector<uint64_t> triangleCursors(firstTriangles);
+        for (uint64_t t = 0; t < sizeT; t++)
+            triangleOrder[triangleCursors[chunkOf(triangles[t][0])]++] = t;
+
+        /* Chunks are independent, each task writes its own file and
+         * bounds. Errors are kept until every task is done. */
+        std::vector<std::exception_ptr> errors(chunks.size());
+        ThreadPool::instance().parallelFor(0, chunks.size(), 1,
+                [&](unsigned int begin, unsigned int end) {
+            for (unsigned int c = begin; c < end; c++) {
+                try {
+                    buildChunk(c, triangles, triangleOrder, firstTriangles[c]);
+                } catch (...) {
+                    errors[c] = std::current_exception();
+                }
+            }
+        });
+        for (unsigned int c = 0; c < chunks.size(); c++)
+            if (errors[c])
+                std::rethrow_exception(errors[c]);
+    }
+    remove(orderPath.c_str());
+
+    ChunkIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHUNKED_MAGIC, 8);
+    header.version = CHUNKED_VERSION;
+    header.chunkCount = chunks.size();
+    header.modelSize = modelSize;
+    header.modelTime = modelTime;
+    header.vertexCount = vertexCount;
+    header.gridSize = gridSize;
+
+    std::string path = filePath("index");
+    std::string partial = path + ".part";
+    std::ofstream out(partial.c_str(), std::ios::binary);
+    out.write((const char *) &header, sizeof(header));
+    out.write((const char *) chunks.data(), chunks.size() * sizeof(MeshChunk));
+    out.close();
+    positionFile->sync();
+    normalFile->sync();
+    orderFile->sync();
+    if (!out || rename(partial.c_str(), path.c_str()) != 0) {
+        remove(partial.c_str());
+        throw Exception("Cannot write " + path);
+    }
+}
+
+/* Writes the triangles of the chunk, with the vertices they use, as a
+ * MeshCache file holding its wide BVH, and sets its bounds */
+void ChunkedMesh::buildChunk(unsigned int chunk, const Triangle *triangles,
+        const uint32_t *triangleOrder, uint64_t firstTriangle) {
+    MeshChunk &meshChunk = chunks[chunk];
+    for (int k = 0; k < 3; k++)
+        meshChunk.low[k] = meshChunk.upp[k] = 0.f;
+    if (meshChunk.triangleCount == 0)
+        return;
+
+    const uint32_t *order = triangleOrder + firstTriangle;
+    std::vector<uint32_t> ids;
+    ids.reserve(3 * meshChunk.triangleCount);
+    for (unsigned int t = 0; t < meshChunk.triangleCount; t++)
+        for (unsigned int j = 0; j < 3; j++)
+            ids.push_back(triangles[order[t]][j]);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    Mesh mesh;
+    mesh.positions().resize(ids.size());
+    mesh.normals().resize(ids.size());
+    for (unsigned int l = 0; l < ids.size(); l++) {
+        mesh.positions()[l] = positions()[ids[l]];
+        mesh.normals()[l] = normals()[ids[l]];
+    }
+    mesh.triangles().resize(meshChunk.triangleCount);
+    for (unsigned int t = 0; t < meshChunk.triangleCount; t++)
+        for (unsigned int j = 0; j < 3; j++)
+            mesh.triangles()[t][j] = std::lower_bound(ids.begin(), ids.end(),
+                    triangles[order[t]][j]) - ids.begin();
+
+    Vec3f low = mesh.positions()[0];
+    Vec3f upp = mesh.positions()[0];
+    for (unsigned int l = 1; l < ids.size(); l++) {
+        for (int k = 0; k < 3; k++) {
+            low[k] = std::min(low[k], mesh.positions()[l][k]);
+            upp[k] = std::max(upp[k], mesh.positions()[l][k]);
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        meshChunk.low[k] = low[k] - CHUNK_MARGIN;
+        meshChunk.upp[k] = upp[k] + CHUNK_MARGIN;
+    }
+
+    BVH bvh(mesh);
+    WideBVH<BVH_WIDTH> wideBVH(bvh);
+    MeshCache cache;
+    std::string path = filePath("chunk" + std::to_string(chunk) + ".mesh");
+    cache.open(modelFilename, path);
+    if (!cache.save(mesh, NULL, &ids, &wideBVH))
+        throw Exception("Cannot write " + path);
+}
+
+/* Binary tree over tracedChunks[begin, end), halved at each level, with
+ * a chunk per leaf */
+void ChunkedMesh::buildTree(unsigned int begin, unsigned int end) {
+    unsigned int index = tree.size();
+    tree.push_back(BVHNode());
+    BVHNode node = BVHNode();
+    for (int k = 0; k < 3; k++) {
+        node.low[k] = chunks[tracedChunks[begin]].low[k];
+        node.upp[k] = chunks[tracedChunks[begin]].upp[k];
+    }
+    for (unsigned int i = begin + 1; i < end; i++) {
+        for (int k = 0; k < 3; k++) {
+            node.low[k] = std::min(node.low[k], chunks[tracedChunks[i]].low[k]);
+            node.upp[k] = std::max(node.upp[k], chunks[tracedChunks[i]].upp[k]);
+        }
+    }
+
+    if (end - begin == 1) {
+        node.offset = begin;
+        node.count = 1;
+        chunkLeaves[tracedChunks[begin]] = index;
+    } else {
+        unsigned int middle = (begin + end) / 2;
+        buildTree(begin, middle);
+        node.offset = tree.size();
+        buildTree(middle, end);
+    }
+    tree[index] = node;
+}
+
+void ChunkedMesh::crossedChunks(const Ray &ray,
+        std::vector<unsigned int> &crossed) const {
+    crossed.clear();
+    if (tree.empty())
+        return;
+
+    unsigned int stack[BVH_STACK_SIZE];
+    unsigned int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        unsigned int index = stack[--size];
+        const BVHNode &node = tree[index];
+        float tNear;
+        if (!node.rayInter(ray, ray.getTMax(), tNear))
+            continue;
+        if (node.isLeaf()) {
+            crossed.push_back(tracedChunks[node.offset]);
+        } else {
+            stack[size++] = node.offset;
+            stack[size++] = index + 1;
+        }
+    }
+}
+
+bool ChunkedMesh::crosses(unsigned int chunk, const Ray &ray) const {
+    float tNear;
+    return chunks[chunk].triangleCount > 0
+        && tree[chunkLeaves[chunk]].rayInter(ray, ray.getTMax(), tNear);
+}
+
+std::shared_ptr<const ResidentChunk> ChunkedMesh::page(unsigned int chunk) {
+    if (resident[chunk]) {
+        recentChunks.splice(recentChunks.begin(), recentChunks,
+                            recentPosition[chunk]);
+        return resident[chunk];
+    }
+
+    std::shared_ptr<const ResidentChunk> loaded = load(chunk);
+    resident[chunk] = loaded;
+    recentChunks.push_front(chunk);
+    recentPosition[chunk] = recentChunks.begin();
+    residentMemory += loaded->memory;
+    pageIns++;
+
+    /* The chunk just read stays, even alone over the budget */
+    while (residentMemory > memoryBudget && recentChunks.size() > 1) {
+        unsigned int last = recentChunks.back();
+        recentChunks.pop_back();
+        residentMemory -= resident[last]->memory;
+        resident[last].reset();
+    }
+    return loaded;
+}
+
+/* Only what tracing needs is kept: the positions, the triangles and the
+ * wide BVH, all read as they were saved */
+std::shared_ptr<const ResidentChunk> ChunkedMesh::load(
+        unsigned int chunk) const {
+    std::string path = filePath("chunk" + std::to_string(chunk) + ".mesh");
+    MeshCache cache;
+    cache.open(modelFilename, path);
+
+    std::shared_ptr<ResidentChunk> loaded(new ResidentChunk());
+    if (!cache.loadMesh(loaded->mesh)
+            || !cache.loadVertexIds(loaded->vertexIds))
+        throw Exception("Broken chunk file " + path);
+    loaded->wideBVH.reset(cache.loadWideBVH(loaded->mesh));
+    if (!loaded->wideBVH)
+        throw Exception("Broken chunk file " + path);
+    loaded->mesh.normals().clear();
+
+    const WideBVH<BVH_WIDTH> &wide = *loaded->wideBVH;
+    loaded->memory = loaded->mesh.positions().size() * sizeof(Vec3f)
+        + loaded->mesh.triangles().size() * sizeof(Triangle)
+        + loaded->vertexIds.size() * sizeof(uint32_t)
+        + wide.getNodes().size() * sizeof(WideNode<BVH_WIDTH>)
+        + wide.getBlocks().size() * sizeof(TriangleBlock<BVH_WIDTH>);
+    return loaded;
+}
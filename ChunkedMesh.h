@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Vec3.h"
+#include "Mesh.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "MappedFile.h"
+
+/* Part of a ChunkedMesh: the vertices lying in one cell of a grid over the
+ * model, and the triangles whose first vertex lies there */
+struct MeshChunk {
+    float low[3];           // Bounds of the triangles
+    float upp[3];
+    uint32_t firstVertex;   // Within the vertex order of the ChunkedMesh
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint32_t padding;
+};
+
+/* The triangles of a chunk paged in for tracing, with the vertices they
+ * use. Global vertex indices map to local ones through vertexIds, which
+ * increase. */
+struct ResidentChunk {
+    Mesh mesh;
+    std::unique_ptr<WideBVH<BVH_WIDTH> > wideBVH;
+    std::vector<uint32_t> vertexIds;
+    size_t memory; // Bytes held by the arrays above
+
+    /* Local index of a global vertex, -1 if no triangle of the chunk uses
+     * it */
+    int localVertex(uint32_t vertex) const;
+};
+
+/* A model too large to be held in memory, cut into spatially coherent
+ * chunks that are traced one at a time. Loading streams the OFF file
+ * into a directory next to it, <model>.chunks, which holds the centered
+ * positions and the normals of every vertex, as Mesh::loadOFF computes
+ * them, and one MeshCache file per chunk with its triangles and wide BVH.
+ * The directory is reused until the model or the budget changes.
+ *
+ * The arrays of every vertex are mapped files, which the system pages as
+ * they are read. Chunk BVHs are paged in on demand and the least recently
+ * used ones are dropped once they exceed the memory budget, which sizes
+ * the chunks. Rays are meant to be traced in batches, one chunk at a time
+ * against all of them, rather than one ray at a time across the chunks:
+ * each chunk a batch crosses is then paged in once for the whole batch. */
+class ChunkedMesh {
+    public :
+        ChunkedMesh(size_t _memoryBudget) : memoryBudget(_memoryBudget),
+            residentMemory(0), pageIns(0) {}
+
+        /* Maps the chunks of the model, cutting it first if needed.
+         * Throws an Exception if the model cannot be read. */
+        void open(const std::string &_modelFilename);
+
+        unsigned int getVertexCount() const {return vertexCount;}
+        const Vec3f * positions() const {
+            return (const Vec3f *) positionFile->begin();
+        }
+        const Vec3f * normals() const {
+            return (const Vec3f *) normalFile->begin();
+        }
+
+        const std::vector<MeshChunk> & getChunks() const {return chunks;}
+        /* Vertices grouped by chunk, each chunk a range of it */
+        const uint32_t * vertexOrder() const {
+            return (const uint32_t *) orderFile->begin();
+        }
+
+        /* Sets crossed to the chunks holding triangles whose bounds the
+         * ray crosses, found through a tree over them */
+        void crossedChunks(const Ray &ray,
+                           std::vector<unsigned int> &crossed) const;
+        bool crosses(unsigned int chunk, const Ray &ray) const;
+
+        /* The chunk's triangles, read from its file if they are not
+         * resident, which may drop others. Paging is meant for a single
+         * thread, the one scheduling the batches. */
+        std::shared_ptr<const ResidentChunk> page(unsigned int chunk);
+        bool isResident(unsigned int chunk) const {
+            return (bool) resident[chunk];
+        }
+
+        unsigned int getPageIns() const {return pageIns;}
+
+    private :
+        std::string modelFilename;
+        std::string directory;
+        uint64_t modelSize;
+        int64_t modelTime; // Modification time, in nanoseconds
+        unsigned int vertexCount;
+        std::vector<MeshChunk> chunks;
+        std::unique_ptr<MappedFile> positionFile;
+        std::unique_ptr<MappedFile> normalFile;
+        std::unique_ptr<MappedFile> orderFile;
+
+        /* Tree over the chunks holding triangles, whose leaves point into
+         * tracedChunks */
+        std::vector<BVHNode> tree;
+        std::vector<unsigned int> tracedChunks;
+        std::vector<unsigned int> chunkLeaves; // Leaf of each traced chunk
+
+        /* Least recently used chunks last */
+        size_t memoryBudget;
+        size_t residentMemory;
+        unsigned int pageIns;
+        std::list<unsigned int> recentChunks;
+        std::vector<std::shared_ptr<const ResidentChunk> > resident;
+        std::vector<std::list<unsigned int>::iterator> recentPosition;
+
+        std::string filePath(const std::string &name) const;
+        unsigned int gridSizeFor(unsigned int vertices) const;
+        bool openChunks();
+        void build();
+        void removeChunkFiles();
+        void streamOFF(unsigned int &sizeV, uint64_t &sizeT);
+        void computeNormals(unsigned int sizeV, uint64_t sizeT);
+        void cut(uint64_t sizeT);
+        void buildChunk(unsigned int chunk, const Triangle *triangles,
+                        const uint32_t *triangleOrder,
+                        uint64_t firstTriangle);
+        void buildTree(unsigned int begin, unsigned int end);
+        std::shared_ptr<const ResidentChunk> load(unsigned int chunk) const;
+};
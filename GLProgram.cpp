@@ -76,6 +76,14 @@ GLint GLProgram::getUniformLocation (const std::string & uniformName) {
     return loc;
 }
 
+GLint GLProgram::getAttribLocation (const std::string & attribName) {
+    const GLchar * cname = attribName.c_str ();
+    GLint loc = glGetAttribLocation (_id, cname);
+    if (loc == -1)
+        printOpenGLError ("Wrong Attribute Variable [" + attribName + "] for Program [" + name () + "]");
+    return loc;
+}
+
 void GLProgram::setUniform1f (GLint location, float value) {
     use ();
     glUniform1f (location, value);
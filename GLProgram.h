@@ -31,6 +31,7 @@ public:
   void use ();
   static void stop ();
   GLint getUniformLocation (const std::string & uniformName);
+  GLint getAttribLocation (const std::string & attribName);
   void setUniform1f (GLint location, float value);
   void setUniform1f (const std::string & name, float value);
   void setUniform2f (GLint location, float value0, float value1);
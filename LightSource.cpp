@@ -1,4 +1,5 @@
 #include "LightSource.h"
+#include "Sampler.h"
 
 void polar2Cartesian (float phi, float theta, float r, float & x, float & y, float & z) {
     x = r * sin (theta) * cos (phi);
@@ -7,10 +8,12 @@ void polar2Cartesian (float phi, float theta, float r, float & x, float & y, flo
 }
 
 LightSource::LightSource() : position(Vec3f(1.0,0.0,0.0)),
-    color(Vec3f(1.f,1.f,1.f)), intensity(1.0) {}
+    color(Vec3f(1.f,1.f,1.f)), intensity(1.0), shape(SHAPE_POINT),
+    size(0.2f) {}
 
 LightSource::LightSource(Vec3f _position, Vec3f _color, float _intensity) :
-    position(_position), color(_color), intensity(_intensity) {}
+    position(_position), color(_color), intensity(_intensity),
+    shape(SHAPE_POINT), size(0.2f) {}
 
 Vec3f LightSource::getPosition()
 {
@@ -29,11 +32,49 @@ float LightSource::getIntensity()
     return intensity;
 }
 
+LightSource::Shape LightSource::getShape()
+{
+    return shape;
+}
+
+float LightSource::getSize()
+{
+    return size;
+}
+
 void LightSource::setColor(Vec3f _color)
 {
     color = _color;
 }
 
+void LightSource::setShape(Shape _shape)
+{
+    shape = _shape;
+}
+
+Vec3f LightSource::samplePoint(const Vec3f &p, float u, float v)
+{
+    Vec3f center = getPosition();
+    if (shape == SHAPE_POINT)
+        return center;
+
+    /* Frame of the light's face, towards p for the sphere and towards the
+     * origin for the rectangle */
+    Vec3f n = normalize(shape == SHAPE_SPHERE ? p - center : -center);
+    Vec3f x, y;
+    n.getTwoOrthogonals(x, y);
+    x.normalize();
+    y.normalize();
+
+    if (shape == SHAPE_SPHERE) {
+        float dx, dy;
+        Sampler::concentricDisk(u, v, dx, dy);
+        return center + size * dx * x + size * dy * y;
+    }
+    return center + size * (2.f * u - 1.f) * x
+        + 0.5f * size * (2.f * v - 1.f) * y;
+}
+
 void LightSource::addR(float r)
 {
     position[0] = std::fmax(0.0, position[0] + r);
@@ -68,3 +109,8 @@ void LightSource::addIntensity(float _intensity)
 {
     intensity += _intensity;
 }
+
+void LightSource::addSize(float _size)
+{
+    size = std::fmax(0.01, size + _size);
+}
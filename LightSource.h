@@ -2,11 +2,19 @@
 
 #include "Vec3.h"
 
+/* A point light, or an area light centered on that point: a sphere, or a
+ * rectangle facing the origin, twice as wide as high. size is the radius
+ * of the sphere and the half width of the rectangle. */
 class LightSource {
+public :
+    enum Shape {SHAPE_POINT, SHAPE_SPHERE, SHAPE_RECTANGLE};
+
 private :
     Vec3f position;
     Vec3f color;
     float intensity;
+    Shape shape;
+    float size;
 
 public :
     LightSource();
@@ -15,7 +23,16 @@ public :
     Vec3f getColor();
     float getIntensity();
 
+    Shape getShape();
+    float getSize();
+
     void setColor(Vec3f _color);
+    void setShape(Shape _shape);
+
+    /* Point of the light seen from p, for (u, v) in [0, 1)^2. Uniform
+     * (u, v) give points uniform over the rectangle, or over the disk of
+     * the sphere facing p. */
+    Vec3f samplePoint(const Vec3f &p, float u, float v);
 
     void addR(float r);
     void addPhi(float phi);
@@ -26,4 +43,5 @@ public :
     void addBlue(float blue);
 
     void addIntensity(float _intensity);
+    void addSize(float _size);
 };
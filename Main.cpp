@@ -18,7 +18,7 @@
 #include <cstdlib>
 #include <algorithm>
 #include <cmath>
-#include <random>
+#include <cfloat>
 
 #include "Vec3.h"
 #include "Camera.h"
@@ -29,6 +29,15 @@
 #include "Ray.h"
 #include "BoundingBox.h"
 #include "BVH.h"
+#include "WideBVH.h"
+#include "Morton.h"
+#include "ThreadPool.h"
+#include "Random.h"
+#include "Sampler.h"
+#include "BakeCache.h"
+#include "MeshCache.h"
+#include "ShadowMap.h"
+#include "StreamingBake.h"
 
 using namespace std;
 
@@ -45,6 +54,19 @@ using namespace std;
 #define LIGHT_COL 1.0,0.0,0.0
 #define LIGHT_INT 1.0
 #define EPSILON 0.0001f
+#define SHADOW_CHUNK 256 // Vertices per task, a multiple of RAY_PACKET_SIZE
+#define AO_CHUNK 64 // Vertices per task of the AO bake
+#define AO_SEED 0x1234 // Key of the per-vertex sample rotations
+#define AO_SAMPLES 32 // Samples per vertex, a power of 2 suits Sobol
+#define AO_RADIUS 1.0f // Distance beyond which occluders are ignored
+#define AO_FRAME_MS 8 // Time given to progressive AO at each frame
+#define AO_ERROR_SCALE 10.f // Standard error of AO displayed as white
+#define AREA_LIGHT_STRATA 4 // Strata along each side of an area light
+#define AREA_LIGHT_SEED 0x5678 // Key of the per-vertex jitters of the strata
+#define SHADOW_MAP_SIZE 512 // Texels along each side of the cube map faces
+#define SHADOW_MAP_FAR 10.f // Farthest distance to the light in the shadow map
+#define SHADOW_MAP_UNIT 1 // Texture unit of the shadow map
+#define STREAMING_MEMORY_MB 1024 // Default budget of the chunks resident in a streaming bake
 
 static const unsigned int DEFAULT_SCREENWIDTH = 1024;
 static const unsigned int DEFAULT_SCREENHEIGHT = 768;
@@ -71,15 +93,44 @@ GLuint vertexVBO;
 GLuint indexVBO;
 GLuint normalVBO;
 GLuint colorVBO;
+GLuint bentNormalVBO;
+static GLint bentNormalAttrib = -1; // Location of bentNormal in the shaders
 static BVH * bvh;
+static WideBVH<BVH_WIDTH> * wideBVH; // Collapsed from bvh, used for tracing
+static std::vector<int> vertexOrder; // Vertices along a Morton curve, for ray packets
+static bool packetShadows = false; // Trace shadow rays as packets
 static LightSource lightSource;
 static std::vector<float> colorResponses; // Cached per-vertex color response, updated at each frame
+static std::vector<float> vertexVisibility; // Visible part of the light, from 0 to 1
+static std::vector<float> vertexAO; // Ambient occlusion, 1 when unoccluded
+static std::vector<float> vertexAOError; // Estimated standard error of the AO
+static std::vector<Vec3f> vertexBentNormal; // Mean unoccluded direction of the AO samples
+static bool bentNormalShading = false; // Diffuse shading from the bent normals
+static bool angleWeightedNormals = false; // Vertex normals weighted by the angles of their triangles
+static bool showAOError = false; // Display the AO error instead of the AO
+static Sampler aoSampler(Sampler::SEQUENCE_SOBOL, AO_SEED);
+static BakeCache bakeCache; // AO and shadows baked for the model
+static MeshCache meshCache; // Loaded model and its default BVH
+static bool writeMeshCache = false; // Save the mesh cache, when IGR_MESH_CACHE is set
+static std::vector<int> vertexOccluder; // Last triangle found shadowing each vertex, -1 if none
+static bool liveShadows = false; // Update shadows when the light moves
+static ShadowMap *shadowMap = NULL; // Created on first use
+static bool shadowMapping = false; // Shadows from the GPU shadow map
+static bool progressiveAO = false; // Accumulate AO samples at each frame
+static std::vector<float> aoSums; // Running sums of the progressive AO
+static std::vector<Vec3f> aoBentSums; // Running sums of the unoccluded directions
+static unsigned int aoPass = 0; // Sample being traced for every vertex
+static unsigned int aoCursor = 0; // Next vertex to trace in that pass
+static unsigned int aoBudget = 1024; // Samples traced per frame
 
 void printUsage () {
     std::cerr << std::endl
         << appTitle << std::endl
         << "Author: " << myName << std::endl << std::endl
-        << "Usage: ./main [<file.off>]" << std::endl
+        << "Usage: ./main [<file.off|file.ply|file.obj>]" << std::endl
+        << "       ./main --stream-bake <file.off>: bakes the AO and the"
+        << " shadows of a model larger than memory, within IGR_MEMORY_MB"
+        << " megabytes of chunks" << std::endl
         << "Commands:" << std::endl
         << "------------------" << std::endl
         << " ?: Print help" << std::endl
@@ -95,96 +146,510 @@ void printUsage () {
         << " b : Blue light source" << std::endl
         << " v : White light source" << std::endl
         << " i, I : Control the intensity of the light source" << std::endl
-        << " t : Compute per vertex shadow" << std::endl
+        << " o : Cycle light shapes (point, sphere, rectangle)" << std::endl
+        << " k, K : Control the size of area lights" << std::endl
+        << " t : Compute per vertex shadow, then update it as the light moves" << std::endl
+        << " T : Toggle shadow updates on light moves" << std::endl
+        << " p : Toggle ray packets for shadows" << std::endl
+        << " m : Toggle GPU shadow mapping" << std::endl
         << " a : Compute per vertex AO" << std::endl
-        << " h : Build BVH" << std::endl
+        << " A : Compute per vertex AO progressively, while rendering" << std::endl
+        << " j : Cycle AO sample sequences (Sobol, random, Halton)" << std::endl
+        << " V : Toggle display of the estimated AO error" << std::endl
+        << " n : Toggle diffuse shading from the bent normals" << std::endl
+        << " N : Toggle angle weighted vertex normals" << std::endl
+        << " h : Build BVH (SAH)" << std::endl
+        << " H : Build BVH (mean split)" << std::endl
+        << " l : Build BVH (Morton codes LBVH)" << std::endl
         << " y : Draw BVH" << std::endl << std::endl;
 }
 
-/* This function updates the shadow value in colorResponses by ray tracing */
+/* Replaces the BVH, and what is derived from it */
+void setBVH(BVH *newBVH)
+{
+    delete bvh;
+    delete wideBVH;
+    bvh = newBVH;
+    wideBVH = new WideBVH<BVH_WIDTH>(*bvh);
+    vertexOrder = mortonOrder(mesh.positions());
+}
+
+/* (Re)builds the BVH and reports its quality */
+void buildBVH(const BVHParams &params)
+{
+    int start = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    setBVH(new BVH(mesh, params));
+    int end = glutGet((GLenum)GLUT_ELAPSED_TIME);
+
+    std::cout << "BVH built in " << end - start << " ms, SAH cost: "
+        << bvh->sahCost() << std::endl;
+}
+
+/* Gives the tracers the default BVH on first use, from the mesh cache if
+ * it holds one, else built then saved there if the cache is written */
+void requireBVH()
+{
+    if (bvh != NULL)
+        return;
+
+    BVH *cached = meshCache.loadBVH(mesh);
+    if (cached != NULL) {
+        setBVH(cached);
+        std::cout << "BVH loaded from the mesh cache" << std::endl;
+        return;
+    }
+    buildBVH(BVHParams());
+    if (writeMeshCache)
+        meshCache.save(mesh, bvh);
+}
+
+/* The shader scales the color by 15 times its w, which holds the ambient
+ * occlusion times the light visibility. Vertices in the shadow keep a
+ * third of the light. The shadow map gives the visibility per fragment
+ * instead. */
+inline void updateResponse(unsigned int i)
+{
+    float magnitude = vertexAO[i];
+    if (showAOError)
+        magnitude = std::min(1.f, AO_ERROR_SCALE * vertexAOError[i]);
+    float visibility = shadowMapping ? 1.f : vertexVisibility[i];
+    colorResponses[4*i + 3] = magnitude * (1.f / 3.f + 2.f / 3.f * visibility);
+}
+
+/* Sends the responses of vertices [begin, end) to the GPU, in the buffer
+ * allocated by init() */
+void uploadColorResponses(unsigned int begin, unsigned int end)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
+    glBufferSubData(GL_ARRAY_BUFFER, 4 * begin * sizeof(float),
+            4 * (end - begin) * sizeof(float), &(colorResponses[4 * begin]));
+}
+
+void uploadColorResponses()
+{
+    uploadColorResponses(0, colorResponses.size() / 4);
+}
+
+/* Sends the AO of vertices [begin, end), with their bent normals */
+void uploadAO(unsigned int begin, unsigned int end)
+{
+    uploadColorResponses(begin, end);
+    glBindBuffer(GL_ARRAY_BUFFER, bentNormalVBO);
+    glBufferSubData(GL_ARRAY_BUFFER, begin * sizeof(Vec3f),
+            (end - begin) * sizeof(Vec3f), &(vertexBentNormal[begin]));
+}
+
+void uploadAO()
+{
+    uploadAO(0, vertexBentNormal.size());
+}
+
+/* Whether the triangle, which must not touch the vertex, blocks its ray */
+inline bool blocksRay(int triangle, const Ray &ray, int vertex)
+{
+    const MeshArray<Vec3f> &positions = mesh.positions();
+    const MeshArray<Triangle> &triangles = mesh.triangles();
+    const Triangle &t = triangles[triangle];
+    return !t.contains(vertex) &&
+        ray.rayTriangleInter(positions[t[0]], positions[t[1]], positions[t[2]]);
+}
+
+/* Visible part of the area light seen from vertex i, the fraction of
+ * AREA_LIGHT_STRATA^2 rays reaching jittered strata of the light. The
+ * corner strata are traced first: when they agree, the vertex is taken as
+ * fully lit or fully shadowed, which only misses occluders smaller than
+ * the light passing between them. occluder is the last triangle found
+ * blocking a ray, tested before tracing the next ones through the BVH. */
+float areaLightVisibility(unsigned int i, int &occluder,
+        unsigned int &traced)
+{
+    const int k = AREA_LIGHT_STRATA;
+    const MeshArray<Vec3f> &positions = mesh.positions();
+    const Vec3f &position = positions[i];
+
+    /* Strata, corners first */
+    static const std::vector<int> strata = [] {
+        std::vector<int> order;
+        int corners[4] = {0, k - 1, k * (k - 1), k * k - 1};
+        order.assign(corners, corners + 4);
+        for (int s = 0; s < k * k; s++) {
+            if (std::find(corners, corners + 4, s) == corners + 4)
+                order.push_back(s);
+        }
+        return order;
+    }();
+
+    int lit = 0;
+    for (int n = 0; n < k * k; n++) {
+        if (n == 4 && (lit == 0 || lit == 4))
+            return lit == 0 ? 0.f : 1.f;
+
+        /* The jitter of a stratum only depends on (vertex, stratum) */
+        int s = strata[n];
+        CounterRNG random(AREA_LIGHT_SEED, i);
+        random.skip(2 * s);
+        float u = (s % k + random.nextFloat()) / k;
+        float v = (s / k + random.nextFloat()) / k;
+        Vec3f light = lightSource.samplePoint(position, u, v);
+        Ray ray = Ray(position, light - position, RAY_EPSILON, 1.f);
+
+        if (occluder >= 0 && blocksRay(occluder, ray, i))
+            continue;
+        int blocker = wideBVH->occluder(ray, i);
+        traced++;
+        if (blocker >= 0)
+            occluder = blocker;
+        else
+            lit++;
+    }
+    return lit / (float) (k * k);
+}
+
+/* This function updates the shadow value in colorResponses by ray tracing.
+ * Every vertex is tested again when the light moves. One whose last
+ * occluder, or the one of the vertex before it on the Morton curve, still
+ * blocks the new ray is confirmed with one triangle test, and the others
+ * are traced through the BVH. Lit vertices are always traced again, as
+ * nothing cached tells that their new ray is still clear. The vertices
+ * confirmed by a cached occluder are counted and reported. Area lights
+ * give soft shadows, from several rays per vertex. */
 void computePerVertexShadow()
 {
     Vec3f lightPos = lightSource.getPosition();
-    std::vector<Vec3f> positions = mesh.positions();
-    std::vector<Triangle> triangles = mesh.triangles();
-
-    for (unsigned int i = 0; i < positions.size(); i++) {
-        Ray ray = Ray(positions[i], lightPos - positions[i]);
-        colorResponses[4*i+3] = 1.0;
-
-        for (unsigned int j = 0; j<triangles.size(); j++) {
-            if (!triangles[j].contains(i)) {
-                int i0 = triangles[j][0];
-                int i1 = triangles[j][1];
-                int i2 = triangles[j][2];
-                if (ray.rayTriangleInter(positions[i0], positions[i1],
-                            positions[i2])) {
-                    colorResponses[4*i+3] = -1.0;
-                }
+    const MeshArray<Vec3f> &positions = mesh.positions();
+
+    /* Shadow rays are traced against the BVH, built on first use. They
+     * are segments ending at the light, at t = 1, so that occluders
+     * lying beyond it are ignored. */
+    requireBVH();
+
+    int start = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    std::atomic<unsigned int> traced(0);
+    std::atomic<unsigned int> confirmed(0); // Shadowed by a cached occluder
+
+    /* Vertices are cut in chunks along the Morton curve, which the pool
+     * balances between threads: occlusion costs vary a lot over the mesh.
+     * Each chunk writes its own vertices of the responses. */
+    ThreadPool::instance().parallelFor(0, vertexOrder.size(), SHADOW_CHUNK,
+            [&](unsigned int begin, unsigned int end) {
+        if (lightSource.getShape() != LightSource::SHAPE_POINT) {
+            int lastOccluder = -1;
+            unsigned int rays = 0;
+            for (unsigned int j = begin; j < end; j++) {
+                int i = vertexOrder[j];
+                int occluder = vertexOccluder[i] >= 0 ?
+                    vertexOccluder[i] : lastOccluder;
+                vertexVisibility[i] = areaLightVisibility(i, occluder, rays);
+                if (occluder >= 0)
+                    lastOccluder = occluder;
+                vertexOccluder[i] = occluder;
+                updateResponse(i);
+            }
+            traced += rays;
+            return;
+        }
+
+        /* Neighbouring vertices cast nearly parallel rays towards the
+         * light, which are traced together as packets in packet mode.
+         * Packets do not tell which triangle blocked them. */
+        RayPacket packet;
+        int packed[RAY_PACKET_SIZE];
+        auto tracePacket = [&]() {
+            packet.finalize();
+            unsigned int blocked = bvh->occluded(packet);
+            for (unsigned int k = 0; k < packet.size; k++) {
+                vertexOccluder[packed[k]] = -1;
+                vertexVisibility[packed[k]] = blocked & (1u << k) ?
+                    0.f : 1.f;
+                updateResponse(packed[k]);
+            }
+            traced += packet.size;
+            packet.clear();
+        };
+
+        int lastOccluder = -1;
+        for (unsigned int j = begin; j < end; j++) {
+            int i = vertexOrder[j];
+            Ray ray = Ray(positions[i], lightPos - positions[i],
+                          RAY_EPSILON, 1.f);
+
+            int occluder = vertexOccluder[i];
+            if (occluder < 0 || !blocksRay(occluder, ray, i))
+                occluder = lastOccluder;
+            if (occluder < 0 || !blocksRay(occluder, ray, i))
+                occluder = -1;
+            else
+                confirmed++;
+
+            if (occluder < 0 && packetShadows) {
+                packed[packet.add(ray, i)] = i;
+                if (packet.size == RAY_PACKET_SIZE)
+                    tracePacket();
+                continue;
             }
+            if (occluder < 0) {
+                occluder = wideBVH->occluder(ray, i);
+                traced++;
+            }
+
+            if (occluder >= 0)
+                lastOccluder = occluder;
+            vertexOccluder[i] = occluder;
+            vertexVisibility[i] = occluder >= 0 ? 0.f : 1.f;
+            updateResponse(i);
         }
+        if (packet.size > 0)
+            tracePacket();
+    });
+    int end = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    std::cout << "Shadows updated in " << end - start << " ms, "
+        << traced << " rays traced for " << positions.size()
+        << " vertices, " << confirmed << " shadowed by a cached occluder"
+        << std::endl;
+
+    uploadColorResponses();
+}
+
+/* Key of the shadows of the current light in the bake cache */
+uint64_t shadowCacheKey()
+{
+    bool area = lightSource.getShape() != LightSource::SHAPE_POINT;
+    return bakeCache.shadowKey(lightSource.getPosition(),
+            lightSource.getShape(), area ? lightSource.getSize() : 0.f,
+            area ? AREA_LIGHT_STRATA * AREA_LIGHT_STRATA : 1);
+}
+
+/* Computes the shadows of the current light, unless the bake cache holds
+ * them, and shows them from then on */
+void bakePerVertexShadow()
+{
+    liveShadows = true;
+    uint64_t key = shadowCacheKey();
+    if (!bakeCache.loadShadows(key, vertexVisibility)) {
+        computePerVertexShadow();
+        bakeCache.saveShadows(key, vertexVisibility);
+        return;
     }
 
-    /* Updating the VBO, sending values to GPU */
-    glGenBuffers(1, &colorVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
-    glBufferData(GL_ARRAY_BUFFER, colorResponses.size() * sizeof(float),
-            &(colorResponses[0]), GL_DYNAMIC_DRAW);
+    /* The cache does not keep the occluders reused by later updates */
+    vertexOccluder.assign(mesh.positions().size(), -1);
+    for (unsigned int i = 0; i < mesh.positions().size(); i++)
+        updateResponse(i);
+    uploadColorResponses();
+    std::cout << "Shadows loaded from the bake cache" << std::endl;
+}
+
+/* Traces the j-th AO sample of vertex i, a direction of the hemisphere
+ * around its normal drawn with a density proportional to the cosine.
+ * Returns 1 if it is unoccluded, else 0: their mean estimates the cosine
+ * weighted visibility. An unoccluded direction is also added to
+ * unoccluded, whose sum over the samples points along the bent normal,
+ * so that the same rays give both. */
+float aoSample(unsigned int i, unsigned int j, float radius, Vec3f &unoccluded)
+{
+    Vec3f x,y;
+    const MeshArray<Vec3f> &positions = mesh.positions();
+    const MeshArray<Vec3f> &normals = mesh.normals();
+    Vec3f position = positions[i];
+    Vec3f normal = normalize(normals[i]);
+    normal.getTwoOrthogonals(x, y);
+    x.normalize();
+    y.normalize();
+
+    float u, v;
+    aoSampler.sample2D(i, j, u, v);
+    Vec3f w = Sampler::cosineHemisphere(u, v, normal, x, y);
+
+    /* Only occluders closer than radius count */
+    Ray ray = Ray(position, w, RAY_EPSILON, radius);
+    if (wideBVH->occluded(ray, i))
+        return 0.f;
+    unoccluded += w;
+    return 1.f;
+}
+
+/* Sets the AO of vertex i, the mean of its first samples, and its bent
+ * normal along unoccluded. Samples are 0 or 1, so that their variance
+ * follows from their mean. The error is the one of independent samples,
+ * which overestimates the one of the low-discrepancy sequences. A vertex
+ * without any unoccluded sample keeps its normal. */
+inline void setAO(unsigned int i, float ao, const Vec3f &unoccluded,
+        unsigned int samples)
+{
+    const MeshArray<Vec3f> &normals = mesh.normals();
+    vertexAO[i] = ao;
+    float length = unoccluded.length();
+    vertexBentNormal[i] = length > 0.f ? unoccluded / length
+        : normalize(normals[i]);
+    vertexAOError[i] = samples > 1 ?
+        std::sqrt(ao * (1.f - ao) / (float) (samples - 1)) : 1.f;
+    updateResponse(i);
+}
+
+/* Prints the mean and largest standard errors of the AO */
+void reportAOError()
+{
+    double mean = 0.;
+    float largest = 0.f;
+    for (unsigned int i = 0; i < vertexAOError.size(); i++) {
+        mean += vertexAOError[i];
+        largest = std::max(largest, vertexAOError[i]);
+    }
+    mean /= std::max<size_t>(1, vertexAOError.size());
+    std::cout << "AO standard error: mean " << mean << ", max " << largest
+        << std::endl;
+}
+
+/* Sets the AO from the bake cache, if it holds the one of these
+ * parameters */
+bool loadCachedAO(int numOfSamples, float radius)
+{
+    std::vector<float> ao;
+    std::vector<Vec3f> bentNormals;
+    if (!bakeCache.loadAO(bakeCache.aoKey(numOfSamples, radius,
+                    aoSampler.getSequence(), AO_SEED), ao, bentNormals))
+        return false;
+
+    for (unsigned int i = 0; i < ao.size(); i++)
+        setAO(i, ao[i], bentNormals[i], numOfSamples);
+    std::cout << "AO loaded from the bake cache" << std::endl;
+    return true;
 }
 
+void saveCachedAO(int numOfSamples, float radius)
+{
+    bakeCache.saveAO(bakeCache.aoKey(numOfSamples, radius,
+                aoSampler.getSequence(), AO_SEED), vertexAO, vertexBentNormal);
+}
+
+/* Bakes the ambient occlusion of every vertex. The j-th sample of a
+ * vertex only depends on (vertex, j), so that the result does not depend
+ * on the number of threads nor on their scheduling. */
 void computePerVertexAO(int numOfSamples, float radius)
 {
-    std::random_device rd;
-    std::default_random_engine generator(rd());
-    std::uniform_real_distribution<float> range(-1.f,1.f);
-
-    std::vector<Vec3f> positions = mesh.positions();
-    std::vector<Vec3f> normals = mesh.normals();
-    std::vector<Triangle> triangles = mesh.triangles();
-
-    for (unsigned int i = 0; i < positions.size(); i++) {
-        Vec3f x,y;
-        Vec3f position = positions[i];
-        Vec3f normal = normalize(normals[i]);
-        normal.getTwoOrthogonals(x, y);
-
-        float ao = 0;
-        for (int j = 0; j < numOfSamples; j++) {
-            /* Generation of a random vector */
-            float u = range(generator);
-            float v = range(generator);
-            Vec3f w = normalize(u*x + v*y + normal);
-
-            Ray ray = Ray(position, w);
-            bool inter = false;
-
-            for(unsigned int k = 0; k < triangles.size(); k++) {
-                if (!triangles[k].contains(i)) {
-                    int i0 = triangles[k][0];
-                    int i1 = triangles[k][1];
-                    int i2 = triangles[k][2];
-                    Vec3f t = (positions[i0]+positions[i1]+positions[i2])/3.f;
-                    float dist = length(position - t);
-                    inter |= ray.rayTriangleInter(positions[i0],
-                            positions[i1], positions[i2]) && (dist < radius);
-                }
-            }
+    progressiveAO = false;
+    if (loadCachedAO(numOfSamples, radius)) {
+        uploadAO();
+        return;
+    }
+
+    requireBVH();
 
-            if(!inter)
-                ao += dot(normal, w);
+    int start = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    ThreadPool::instance().parallelFor(0, mesh.positions().size(), AO_CHUNK,
+            [&](unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            float ao = 0;
+            Vec3f unoccluded;
+            for (int j = 0; j < numOfSamples; j++)
+                ao += aoSample(i, j, radius, unoccluded);
+            setAO(i, ao / (float) numOfSamples, unoccluded, numOfSamples);
         }
+    });
+    int end = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    std::cout << "AO baked in " << end - start << " ms with "
+        << numOfSamples << " " << aoSampler.sequenceName()
+        << " samples per vertex" << std::endl;
+    if (showAOError)
+        reportAOError();
 
-        ao *= 1.f/(float) numOfSamples;
+    saveCachedAO(numOfSamples, radius);
+    uploadAO();
+}
 
-        /* Multiplication of albedo by AO factor */
-        colorResponses[4*i + 3] *= ao;
+/* Restarts the progressive AO, which idle() then refines frame by frame */
+void startProgressiveAO(int numOfSamples, float radius)
+{
+    progressiveAO = false;
+    if (loadCachedAO(numOfSamples, radius)) {
+        uploadAO();
+        return;
     }
 
-    /* Updating the VBO, sending values to GPU */
-    glGenBuffers(1, &colorVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
-    glBufferData(GL_ARRAY_BUFFER, colorResponses.size() * sizeof(float),
-            &(colorResponses[0]), GL_DYNAMIC_DRAW);
+    requireBVH();
+
+    aoSums.assign(mesh.positions().size(), 0.f);
+    aoBentSums.assign(mesh.positions().size(), Vec3f());
+    aoPass = 0;
+    aoCursor = 0;
+    progressiveAO = true;
+}
+
+/* Traces about aoBudget AO samples, pass after pass over the vertices.
+ * Each vertex adds its samples to its sum in the order of the blocking
+ * bake, so both end on the same values. The budget then adapts so that
+ * the next frame spends about AO_FRAME_MS on AO. */
+void progressPerVertexAO(int numOfSamples, float radius)
+{
+    unsigned int n = mesh.positions().size();
+    unsigned int budget = aoBudget;
+
+    int start = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    while (budget > 0 && aoPass < (unsigned int) numOfSamples) {
+        unsigned int begin = aoCursor;
+        unsigned int end = std::min(n, begin + budget);
+
+        ThreadPool::instance().parallelFor(begin, end, AO_CHUNK,
+                [&](unsigned int chunkBegin, unsigned int chunkEnd) {
+            for (unsigned int i = chunkBegin; i < chunkEnd; i++) {
+                aoSums[i] += aoSample(i, aoPass, radius, aoBentSums[i]);
+                setAO(i, aoSums[i] / (float) (aoPass + 1), aoBentSums[i],
+                        aoPass + 1);
+            }
+        });
+        uploadAO(begin, end);
+
+        budget -= end - begin;
+        aoCursor = end;
+        if (aoCursor == n) {
+            aoCursor = 0;
+            aoPass++;
+        }
+    }
+    int elapsed = glutGet((GLenum)GLUT_ELAPSED_TIME) - start;
+
+    if (aoPass == (unsigned int) numOfSamples) {
+        progressiveAO = false;
+        std::cout << "Progressive AO done" << std::endl;
+        if (showAOError)
+            reportAOError();
+        saveCachedAO(numOfSamples, radius);
+    }
+
+    /* The timer counts milliseconds, so short frames only double it */
+    if (elapsed * 2 < AO_FRAME_MS)
+        aoBudget = std::min(2 * aoBudget, 1u << 24);
+    else
+        aoBudget = std::max(64u, (unsigned int)
+                ((unsigned long long) aoBudget * AO_FRAME_MS / elapsed));
+}
+
+/* Recomputes the vertex normals, then the AO, which is sampled around
+ * them: the one cached for the new normals, if any, else none */
+void setAngleWeightedNormals(bool angleWeighted)
+{
+    angleWeightedNormals = angleWeighted;
+    int start = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    mesh.recomputeNormals(angleWeighted);
+    int end = glutGet((GLenum)GLUT_ELAPSED_TIME);
+    std::cout << (angleWeighted ? "Angle weighted" : "Uniform")
+        << " normals computed in " << end - start << " ms" << std::endl;
+
+    const MeshArray<Vec3f> &normals = mesh.normals();
+    glBindBuffer(GL_ARRAY_BUFFER, normalVBO);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, normals.size() * sizeof(Vec3f),
+            normals.data());
+    bakeCache.setNormals(normals);
+
+    progressiveAO = false;
+    vertexAO.assign(normals.size(), 1.f);
+    vertexAOError.assign(normals.size(), 0.f);
+    for (unsigned int i = 0; i < normals.size(); i++)
+        vertexBentNormal[i] = normalize(normals[i]);
+    loadCachedAO(AO_SAMPLES, AO_RADIUS);
+    for (unsigned int i = 0; i < normals.size(); i++)
+        updateResponse(i);
+    uploadAO();
 }
 
 void init (const char * modelFilename) {
@@ -200,7 +665,22 @@ void init (const char * modelFilename) {
     glEnable (GL_NORMALIZE);
     glLineWidth (2.0); // Set the width of edges in GL_LINE polygon mode
     glClearColor (0.0f, 0.0f, 0.0f, 1.0f); // Background color
-    mesh.loadOFF (modelFilename);
+    /* The mesh cache is read when it is there, but only written on
+     * request: models may lie in directories that are not ours */
+    const char * env = getenv ("IGR_MESH_CACHE");
+    writeMeshCache = env != NULL && atoi (env) > 0;
+    meshCache.open (modelFilename);
+    if (!meshCache.loadMesh (mesh)) {
+        try {
+            mesh.load (modelFilename);
+        } catch (Exception & e) {
+            cerr << e.msg () << endl;
+            exit (1);
+        }
+        if (writeMeshCache)
+            meshCache.save (mesh, NULL);
+    }
+    bakeCache.open (modelFilename, mesh);
     colorResponses.resize (4 * mesh.positions().size(), 0.0f);
     camera.resize (DEFAULT_SCREENWIDTH, DEFAULT_SCREENHEIGHT);
     try {
@@ -240,31 +720,63 @@ void init (const char * modelFilename) {
 
     glProgram->setUniform1i("brdf_mode", brdf_mode);
 
-    /* Settting 4th compenent of colors as 1 */
+    /* Settting 4th compenent of colors as 1: lit and unoccluded */
+    vertexVisibility.assign(mesh.positions().size(), 1.f);
+    vertexAO.assign(mesh.positions().size(), 1.f);
+    vertexAOError.assign(mesh.positions().size(), 0.f);
+    const MeshArray<Vec3f> &positions = mesh.positions();
+    const MeshArray<Vec3f> &normals = mesh.normals();
+    const MeshArray<Triangle> &triangles = mesh.triangles();
+    vertexBentNormal.resize(positions.size());
+    for (unsigned int i = 0; i < positions.size(); i++)
+        vertexBentNormal[i] = normalize(normals[i]);
+    vertexOccluder.assign(mesh.positions().size(), -1);
     for (unsigned int i = 0; i < mesh.positions().size(); i++) {
-        colorResponses[4*i + 3] = 1.f;
+        updateResponse(i);
     }
 
-    /* VBO setup */
+    /* VBO setup, read in place from the mesh cache's mapping when the
+     * mesh comes from there */
     glGenBuffers(1, &vertexVBO);
     glBindBuffer(GL_ARRAY_BUFFER, vertexVBO);
-    glBufferData(GL_ARRAY_BUFFER, mesh.positions().size() * sizeof(Vec3f),
-            &(mesh.positions()[0]), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(Vec3f),
+            positions.data(), GL_STATIC_DRAW);
 
     glGenBuffers(1, &indexVBO);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexVBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.triangles().size() * sizeof(Triangle),
-            &(mesh.triangles()[0]), GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(Triangle),
+            triangles.data(), GL_STATIC_DRAW);
 
     glGenBuffers(1, &normalVBO);
     glBindBuffer(GL_ARRAY_BUFFER, normalVBO);
-    glBufferData(GL_ARRAY_BUFFER, mesh.normals().size() * sizeof(Vec3f),
-            &(mesh.normals()[0]), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(Vec3f),
+            normals.data(), GL_STATIC_DRAW);
 
     glGenBuffers(1, &colorVBO);
     glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
     glBufferData(GL_ARRAY_BUFFER, colorResponses.size() * sizeof(float),
             &(colorResponses[0]), GL_DYNAMIC_DRAW);
+
+    /* Bent normals go through a generic attribute, the fixed ones are taken */
+    glGenBuffers(1, &bentNormalVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, bentNormalVBO);
+    glBufferData(GL_ARRAY_BUFFER, vertexBentNormal.size() * sizeof(Vec3f),
+            &(vertexBentNormal[0]), GL_DYNAMIC_DRAW);
+    bentNormalAttrib = glProgram->getAttribLocation("bentNormal");
+    if (bentNormalAttrib >= 0)
+        glEnableVertexAttribArray(bentNormalAttrib);
+
+    /* Results baked in a previous run are shown right away */
+    loadCachedAO(AO_SAMPLES, AO_RADIUS);
+    std::vector<float> visibility;
+    if (bakeCache.loadShadows(shadowCacheKey(), visibility)) {
+        vertexVisibility = visibility;
+        liveShadows = true;
+        std::cout << "Shadows loaded from the bake cache" << std::endl;
+    }
+    for (unsigned int i = 0; i < mesh.positions().size(); i++)
+        updateResponse(i);
+    uploadAO();
 }
 
 void renderScene () {
@@ -277,6 +789,11 @@ void renderScene () {
     glBindBuffer(GL_ARRAY_BUFFER, normalVBO);
     glNormalPointer(GL_FLOAT, 0, 0);
 
+    if (bentNormalAttrib >= 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, bentNormalVBO);
+        glVertexAttribPointer(bentNormalAttrib, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    }
+
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexVBO);
     glDrawElements(GL_TRIANGLES, 3*mesh.triangles().size(), GL_UNSIGNED_INT, 0);
 }
@@ -286,6 +803,12 @@ void reshape(int w, int h) {
 }
 
 void display () {
+    /* The shadow map follows the light at each frame */
+    if (shadowMapping) {
+        shadowMap->render (lightSource.getPosition (), renderScene);
+        glProgram->use ();
+        shadowMap->bind (SHADOW_MAP_UNIT);
+    }
     glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     camera.apply ();
     renderScene ();
@@ -293,6 +816,46 @@ void display () {
     glutSwapBuffers ();
 }
 
+/* Sends the new light position to the shader, and refreshes the shadows
+ * once they are shown */
+void lightChanged() {
+    Vec3f lightPos = lightSource.getPosition();
+    glProgram->setUniform3f("lightPos", lightPos[0], lightPos[1], lightPos[2]);
+    if (liveShadows && !shadowMapping)
+        computePerVertexShadow();
+}
+
+/* Switches between the shadows traced per vertex on the CPU and the shadow
+ * map, which only handles the center of the light */
+void toggleShadowMapping() {
+    if (shadowMap == NULL) {
+        try {
+            shadowMap = new ShadowMap(SHADOW_MAP_SIZE, SHADOW_MAP_FAR);
+        } catch (Exception & e) {
+            cerr << e.msg () << endl;
+            return;
+        }
+        glProgram->use();
+    }
+
+    shadowMapping = !shadowMapping;
+    std::cout << "Shadow mapping " << (shadowMapping ? "on" : "off")
+        << std::endl;
+    glProgram->setUniform1i("shadowMapping", shadowMapping);
+    glProgram->setUniform1i("shadowMap", SHADOW_MAP_UNIT);
+    glProgram->setUniform1f("shadowFar", shadowMap->getFar());
+    glProgram->setUniform1f("shadowMapSize", shadowMap->getSize());
+
+    /* Per vertex shadows were not updated while the shadow map was on */
+    if (!shadowMapping && liveShadows) {
+        computePerVertexShadow();
+        return;
+    }
+    for (unsigned int i = 0; i < mesh.positions().size(); i++)
+        updateResponse(i);
+    uploadColorResponses();
+}
+
 void key (unsigned char keyPressed, int x, int y) {
     switch (keyPressed) {
     case 'f':
@@ -304,34 +867,22 @@ void key (unsigned char keyPressed, int x, int y) {
             fullScreen = true;
         }
         break;
-    case 'z': {
+    case 'z':
         lightSource.addTheta(0.1);
-        Vec3f lightPos = lightSource.getPosition();
-        glProgram->setUniform3f("lightPos",
-            lightPos[0], lightPos[1], lightPos[2]);
+        lightChanged();
         break;
-        }
-    case 's': {
+    case 's':
         lightSource.addTheta(-0.1);
-        Vec3f lightPos = lightSource.getPosition();
-        glProgram->setUniform3f("lightPos",
-            lightPos[0], lightPos[1], lightPos[2]);
+        lightChanged();
         break;
-        }
-    case 'q': {
+    case 'q':
         lightSource.addPhi(0.1);
-        Vec3f lightPos = lightSource.getPosition();
-        glProgram->setUniform3f("lightPos",
-            lightPos[0], lightPos[1], lightPos[2]);
+        lightChanged();
         break;
-        }
-    case 'd': {
+    case 'd':
         lightSource.addPhi(-0.1);
-        Vec3f lightPos = lightSource.getPosition();
-        glProgram->setUniform3f("lightPos",
-            lightPos[0], lightPos[1], lightPos[2]);
+        lightChanged();
         break;
-        }
     case 'r': {
         lightSource.setColor(Vec3f(1.0,0.0,0.0));
         Vec3f lightColor = lightSource.getColor();
@@ -396,17 +947,85 @@ void key (unsigned char keyPressed, int x, int y) {
         glPolygonMode (GL_FRONT_AND_BACK, mode[1] ==  GL_FILL ? GL_LINE : GL_FILL);
         break;
         break;
+    case 'o' : {
+        LightSource::Shape shape = (LightSource::Shape)
+            ((lightSource.getShape() + 1) % 3);
+        const char *names[3] = {"point", "sphere", "rectangle"};
+        lightSource.setShape(shape);
+        std::cout << "Light shape: " << names[shape] << std::endl;
+        lightChanged();
+        break;
+        }
+    case 'k' :
+        lightSource.addSize(-0.05);
+        lightChanged();
+        break;
+    case 'K' :
+        lightSource.addSize(0.05);
+        lightChanged();
+        break;
     case 't' :
+        bakePerVertexShadow();
+        break;
+    case 'T' :
+        liveShadows = !liveShadows;
+        std::cout << "Live shadows " << (liveShadows ? "on" : "off")
+            << std::endl;
+        if (liveShadows)
+            computePerVertexShadow();
+        break;
+    case 'p' :
+        packetShadows = !packetShadows;
+        std::cout << "Packet shadows " << (packetShadows ? "on" : "off")
+            << std::endl;
         computePerVertexShadow();
         break;
     case 'a' :
-        computePerVertexAO(100, 1.0);
+        computePerVertexAO(AO_SAMPLES, AO_RADIUS);
+        break;
+    case 'A' :
+        startProgressiveAO(AO_SAMPLES, AO_RADIUS);
+        break;
+    case 'j' :
+        aoSampler.setSequence((Sampler::Sequence)
+                ((aoSampler.getSequence() + 1) % 3));
+        std::cout << "AO sequence: " << aoSampler.sequenceName()
+            << std::endl;
+        break;
+    case 'm' :
+        toggleShadowMapping();
+        break;
+    case 'n' :
+        bentNormalShading = !bentNormalShading;
+        glProgram->setUniform1i("bentNormalShading", bentNormalShading);
+        std::cout << "Bent normal shading "
+            << (bentNormalShading ? "on" : "off") << std::endl;
+        break;
+    case 'N' :
+        setAngleWeightedNormals(!angleWeightedNormals);
+        break;
+    case 'V' :
+        showAOError = !showAOError;
+        for (unsigned int i = 0; i < mesh.positions().size(); i++)
+            updateResponse(i);
+        uploadColorResponses();
+        if (showAOError)
+            reportAOError();
         break;
     case 'h' :
-        bvh = new BVH(mesh);
+        buildBVH(BVHParams(BVHParams::SPLIT_SAH));
+        break;
+    case 'H' :
+        buildBVH(BVHParams(BVHParams::SPLIT_MEAN));
+        break;
+    case 'l' :
+        buildBVH(BVHParams(BVHParams::SPLIT_LBVH));
         break;
     case 'y' :
-        bvh->draw(colorResponses);
+        if (bvh != NULL) {
+            bvh->draw(colorResponses);
+            uploadColorResponses();
+        }
         break;
     default:
         printUsage ();
@@ -437,10 +1056,38 @@ void idle () {
         glutSetWindowTitle (title.c_str ());
         lastTime = currentTime;
     }
+    if (progressiveAO)
+        progressPerVertexAO(AO_SAMPLES, AO_RADIUS);
     glutPostRedisplay ();
 }
 
+/* Bakes the model out of core, with the parameters of the viewer and
+ * without any window */
+int streamingBakeMain (const char * filename) {
+    StreamingBakeParams params;
+    params.aoSamples = AO_SAMPLES;
+    params.aoRadius = AO_RADIUS;
+    params.aoSampler = Sampler(Sampler::SEQUENCE_SOBOL, AO_SEED);
+    /* LIGHT_POS is in the polar coordinates of LightSource, which the
+     * viewer traces toward as a point */
+    LightSource light(Vec3f(LIGHT_POS), Vec3f(LIGHT_COL), LIGHT_INT);
+    params.lightPos = light.getPosition();
+    const char * env = getenv ("IGR_MEMORY_MB");
+    size_t megabytes = env != NULL && atoi (env) > 0 ? atoi (env)
+        : STREAMING_MEMORY_MB;
+    params.memoryBudget = megabytes << 20;
+    try {
+        streamingBake (filename, params);
+    } catch (Exception & e) {
+        cerr << e.msg () << endl;
+        return 1;
+    }
+    return 0;
+}
+
 int main (int argc, char ** argv) {
+    if (argc == 3 && string (argv[1]) == "--stream-bake")
+        return streamingBakeMain (argv[2]);
     if (argc > 2) {
         printUsage ();
         exit (1);
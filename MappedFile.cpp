@@ -0,0 +1,86 @@
+#include "MappedFile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Exception.h"
+
+MappedFile::MappedFile(const std::string &filename, Access access) :
+    data(NULL), size(0), writable(false) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw Exception("Cannot open " + filename + ": " + strerror(errno));
+
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        std::string reason = strerror(errno);
+        close(fd);
+        throw Exception("Cannot read " + filename + ": " + reason);
+    }
+
+    size = status.st_size;
+    map(fd, filename, access);
+}
+
+MappedFile::MappedFile(const std::string &filename, size_t _size,
+        Access access) :
+    data(NULL), size(_size), writable(true) {
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        throw Exception("Cannot create " + filename + ": " + strerror(errno));
+
+    /* Bytes added are sparse, they only take room once written */
+    if (ftruncate(fd, size) != 0) {
+        std::string reason = strerror(errno);
+        close(fd);
+        throw Exception("Cannot write " + filename + ": " + reason);
+    }
+    map(fd, filename, access);
+}
+
+/* Maps size bytes of the file, then closes it: the mapping outlives the
+ * descriptor */
+void MappedFile::map(int fd, const std::string &filename, Access access) {
+    if (size > 0) {
+        void *mapping = mmap(NULL, size,
+                writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            std::string reason = strerror(errno);
+            close(fd);
+            throw Exception("Cannot map " + filename + ": " + reason);
+        }
+        if (access == ACCESS_SEQUENTIAL)
+            madvise(mapping, size, MADV_SEQUENTIAL);
+        else if (access == ACCESS_RANDOM)
+            madvise(mapping, size, MADV_RANDOM);
+        data = (char *) mapping;
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data != NULL)
+        munmap(data, size);
+}
+
+void MappedFile::sync() {
+    if (writable && data != NULL && msync(data, size, MS_SYNC) != 0)
+        throw Exception(std::string("Cannot write a mapped file: ")
+                        + strerror(errno));
+}
+
+bool MappedFile::stamp(const std::string &filename, uint64_t &fileSize,
+        int64_t &fileTime) {
+    struct stat status;
+    if (stat(filename.c_str(), &status) != 0)
+        return false;
+    fileSize = status.st_size;
+    fileTime = (int64_t) status.st_mtim.tv_sec * 1000000000
+        + status.st_mtim.tv_nsec;
+    return true;
+}
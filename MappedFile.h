@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* A file mapped in memory for the lifetime of the object, so that parsers
+ * read it in place instead of through a stream. Files are mapped read-only
+ * unless they are created with their size, in which case what is written
+ * to the mapping reaches the file: the system pages it in and out, so
+ * that arrays larger than memory can live there. Throws an Exception if
+ * the file cannot be opened, created or mapped. */
+class MappedFile {
+    public :
+        /* How the mapping will be read, told to the system so that it
+         * reads ahead, or not. ACCESS_NORMAL gives no hint. */
+        enum Access {ACCESS_NORMAL, ACCESS_SEQUENTIAL, ACCESS_RANDOM};
+
+        MappedFile(const std::string &filename,
+                   Access access = ACCESS_SEQUENTIAL);
+        /* Opens the file for writing, creating it if needed, and sets its
+         * size. What it holds is kept, bytes added are zeros. */
+        MappedFile(const std::string &filename, size_t size,
+                   Access access = ACCESS_NORMAL);
+        ~MappedFile();
+
+        const char * begin() const {return data;}
+        const char * end() const {return data + size;}
+        size_t getSize() const {return size;}
+
+        /* NULL for a read-only mapping */
+        char * writableBegin() {return writable ? data : NULL;}
+
+        /* Writes the modified pages to the file before returning */
+        void sync();
+
+        /* Size and modification time, in nanoseconds, of a file. Returns
+         * false if it cannot be read. */
+        static bool stamp(const std::string &filename, uint64_t &fileSize,
+                          int64_t &fileTime);
+
+    private :
+        char *data; // NULL for an empty file
+        size_t size;
+        bool writable;
+
+        void map(int fd, const std::string &filename, Access access);
+
+        MappedFile(const MappedFile &);
+        MappedFile & operator=(const MappedFile &);
+};
@@ -11,15 +11,30 @@
 
 #include "Mesh.h"
 #include <iostream>
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <sstream>
 #include <string>
+#include "Exception.h"
+#include "MappedFile.h"
+#include "TextScanner.h"
+#include "ThreadPool.h"
 #define PLANE false
 #define HEIGHT 10.0
 #define WIDTH 5.0
 #define HEIGHT_RES 100
 #define WIDTH_RES 50
 #define YVALUE -3.0
+#define OFF_PARALLEL_SIZE (4 << 20) // Bytes of vertices and faces from which OFF files are parsed in parallel
+#define OFF_CHUNK_SIZE (1 << 20) // Bytes of lines parsed by a task
+#define NORMALS_GRAIN 4096u // Triangles per block, at least, and vertices per task of recomputeNormals
+#define NORMALS_BLOCKS 256u // Blocks of triangles of recomputeNormals, at most
+#define NORMALS_BUCKET 4096u // Vertices per bucket of recomputeNormals, sorted by one task
 
 using namespace std;
 
@@ -29,26 +44,195 @@ void Mesh::clear () {
     m_triangles.clear ();
 }
 
-void Mesh::loadOFF (const std::string & filename) {
-    clear ();
-	ifstream in (filename.c_str ());
-    if (!in)
-        exit (1);
-	string offString;
-    unsigned int sizeV, sizeT, tmp;
-    in >> offString >> sizeV >> sizeT >> tmp;
+/* Reads the vertices and the faces following the counts, as a sequence of
+ * numbers. Polygons are split in fans of triangles. Anything following
+ * the indices on the line, such as a color, is skipped. */
+void Mesh::loadOFFSequential (TextScanner & in, unsigned int sizeV,
+                              unsigned int sizeT, bool vertexFields) {
     m_positions.resize (sizeV);
-    m_triangles.resize (sizeT);
-    for (unsigned int i = 0; i < sizeV; i++)
-        in >> m_positions[i];
-    int s;
+    for (unsigned int i = 0; i < sizeV; i++) {
+        for (unsigned int k = 0; k < 3; k++)
+            m_positions[i][k] = in.readFloat ();
+        if (vertexFields)
+            in.skipLine (); // Colors, normals or texture coordinates
+    }
+
+    m_triangles.clear ();
+    m_triangles.reserve (sizeT);
     for (unsigned int i = 0; i < sizeT; i++) {
-        in >> s;
-        for (unsigned int j = 0; j < 3; j++)
-            in >> m_triangles[i][j];
+        unsigned int n = in.readUInt ();
+        if (n < 3)
+            in.error ("face with less than 3 vertices");
+        unsigned int v[3];
+        for (unsigned int j = 0; j < n; j++) {
+            v[std::min (j, 2u)] = in.readUInt ();
+            if (v[std::min (j, 2u)] >= sizeV)
+                in.error ("vertex index out of range");
+            if (j >= 2) {
+                m_triangles.push_back (Triangle (v[0], v[1], v[2]));
+                v[1] = v[2];
+            }
+        }
+        in.skipLine ();
+    }
+}
+
+/* Lines of the body of an OFF file, parsed by one task */
+struct OFFChunk {
+    const char * begin;
+    const char * end;        // Past a newline, or the end of the file
+    unsigned int lines;
+    unsigned int records;    // Lines holding a vertex or a face
+    unsigned int firstLine;  // Line number of begin
+    unsigned int firstRecord;
+    std::exception_ptr error;
+
+    OFFChunk (const char * _begin, const char * _end) :
+        begin (_begin), end (_end), lines (0), records (0), firstLine (0),
+        firstRecord (0) {}
+};
+
+static inline const char * endOfLine (const char * c, const char * end) {
+    const char * newline = (const char *) memchr (c, '\n', end - c);
+    return newline != NULL ? newline : end;
+}
+
+/* Whether the line holds anything but blanks and a comment */
+static inline bool isRecord (const char * c, const char * end) {
+    while (c != end && (unsigned char) *c <= ' ')
+        c++;
+    return c != end && *c != '#';
+}
+
+/* Parses the body of an OFF file on the thread pool, for files holding one
+ * vertex or one face per line. Chunks of lines first count their records,
+ * which tells each of them the index of its first vertex or face, then
+ * write them in place. Returns false, and leaves the parse to
+ * loadOFFSequential, for other layouts and for faces that are not
+ * triangles, whose number of triangles is not known in advance. Errors
+ * are the ones of the first malformed line. */
+bool Mesh::loadOFFParallel (const std::string & filename, const char * body,
+                            const char * end, unsigned int firstLine,
+                            unsigned int sizeV, unsigned int sizeT) {
+    ThreadPool & pool = ThreadPool::instance ();
+
+    std::vector<OFFChunk> chunks;
+    for (const char * c = body; c != end; ) {
+        const char * chunkEnd = end;
+        if (end - c > OFF_CHUNK_SIZE) {
+            chunkEnd = endOfLine (c + OFF_CHUNK_SIZE, end);
+            chunkEnd += chunkEnd != end;
+        }
+        chunks.push_back (OFFChunk (c, chunkEnd));
+        c = chunkEnd;
+    }
+
+    pool.parallelFor (0, chunks.size (), 1,
+            [&] (unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            OFFChunk & chunk = chunks[i];
+            for (const char * c = chunk.begin; c != chunk.end; ) {
+                const char * lineEnd = endOfLine (c, chunk.end);
+                chunk.lines++;
+                chunk.records += isRecord (c, lineEnd);
+                c = lineEnd + (lineEnd != chunk.end);
+            }
+        }
+    });
+
+    uint64_t records = 0;
+    for (unsigned int i = 0; i < chunks.size (); i++) {
+        chunks[i].firstLine = i > 0 ? chunks[i-1].firstLine + chunks[i-1].lines
+            : firstLine;
+        chunks[i].firstRecord = records;
+        records += chunks[i].records;
     }
-    in.close ();
+    if (records != (uint64_t) sizeV + sizeT)
+        return false;
+
+    /* Indices are checked as the faces are read */
+    m_positions.resize (sizeV);
+    m_triangles.resize (sizeT);
+    std::atomic<bool> polygons (false);
+    pool.parallelFor (0, chunks.size (), 1,
+            [&] (unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            OFFChunk & chunk = chunks[i];
+            unsigned int line = chunk.firstLine;
+            unsigned int record = chunk.firstRecord;
+            try {
+                for (const char * c = chunk.begin; c != chunk.end; line++) {
+                    const char * lineEnd = endOfLine (c, chunk.end);
+                    if (isRecord (c, lineEnd)) {
+                        TextScanner in (c, lineEnd, filename, line);
+                        if (record < sizeV) {
+                            for (unsigned int k = 0; k < 3; k++)
+                                m_positions[record][k] = in.readFloat ();
+                        } else if (in.readUInt () != 3) {
+                            polygons = true;
+                        } else {
+                            Triangle & t = m_triangles[record - sizeV];
+                            for (unsigned int j = 0; j < 3; j++) {
+                                t[j] = in.readUInt ();
+                                if (t[j] >= sizeV)
+                                    in.error ("vertex index out of range");
+                            }
+                        }
+                        record++;
+                    }
+                    c = lineEnd + (lineEnd != chunk.end);
+                }
+            } catch (...) {
+                chunk.error = std::current_exception ();
+            }
+        }
+    });
+
+    for (unsigned int i = 0; i < chunks.size (); i++)
+        if (chunks[i].error)
+            std::rethrow_exception (chunks[i].error);
+    return !polygons;
+}
 
+bool Mesh::readOFFHeader (TextScanner & in) {
+    const char * token;
+    const char * tokenEnd;
+    if (!in.readToken (token, tokenEnd) || tokenEnd - token < 3
+            || strncmp (tokenEnd - 3, "OFF", 3) != 0)
+        in.error ("missing OFF header");
+    if (std::find (token, tokenEnd - 3, 'n') != tokenEnd - 3
+            && in.readUInt () < 3)
+        in.error ("less than 3 dimensions");
+    return tokenEnd - token > 3;
+}
+
+void Mesh::loadOFF (const std::string & filename) {
+    clear ();
+    MappedFile file (filename);
+    TextScanner in (file.begin (), file.end (), filename);
+    bool vertexFields = readOFFHeader (in);
+    unsigned int sizeV = in.readUInt ();
+    unsigned int sizeT = in.readUInt ();
+    in.readUInt (); // Edges, unused
+    if (sizeV == 0)
+        in.error ("no vertex");
+
+    /* Vertices and faces start on the line after the counts */
+    const char * body = (const char *) memchr (in.position (), '\n',
+            file.end () - in.position ());
+    body = body != NULL ? body + 1 : file.end ();
+    unsigned int bodyLine = 1 + std::count (file.begin (), body, '\n');
+    if (file.end () - body < OFF_PARALLEL_SIZE
+            || ThreadPool::instance ().size () == 1
+            || !loadOFFParallel (filename, body, file.end (), bodyLine,
+                                 sizeV, sizeT))
+        loadOFFSequential (in, sizeV, sizeT, vertexFields);
+    finishLoading ();
+}
+
+/* Adds the plane if asked, then centers the mesh and computes its normals,
+ * whatever the format it comes from */
+void Mesh::finishLoading () {
     if (PLANE) {
         for(int i = 0; i < HEIGHT_RES; i++) {
             for(int j = 0; j < WIDTH_RES; j++) {
@@ -71,19 +255,530 @@ void Mesh::loadOFF (const std::string & filename) {
     recomputeNormals ();
 }
 
-void Mesh::recomputeNormals () {
-    m_normals.clear ();
-    m_normals.resize (m_positions.size (), Vec3f (0.f, 0.f, 0.f));
-    for (unsigned int i = 0; i < m_triangles.size (); i++) {
-        Vec3f e01 = m_positions[m_triangles[i][1]] -  m_positions[m_triangles[i][0]];
-        Vec3f e02 = m_positions[m_triangles[i][2]] -  m_positions[m_triangles[i][0]];
-        Vec3f n = cross (e01, e02);
-        n.normalize ();
-        for (unsigned int j = 0; j < 3; j++)
-            m_normals[m_triangles[i][j]] += n;
-    }
-    for (unsigned int i = 0; i < m_normals.size (); i++)
-        m_normals[i].normalize ();
+/* Scalar types of PLY properties */
+enum PLYType {
+    PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32,
+    PLY_FLOAT32, PLY_FLOAT64, PLY_NONE
+};
+
+static const unsigned int plyTypeSizes[PLY_NONE] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+/* Type of a PLY type name, in either of its spellings */
+static PLYType plyType (const std::string & name) {
+    static const char * names[PLY_NONE][2] = {
+        {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"},
+        {"ushort", "uint16"}, {"int", "int32"}, {"uint", "uint32"},
+        {"float", "float32"}, {"double", "float64"}
+    };
+    for (int t = 0; t < PLY_NONE; t++)
+        if (name == names[t][0] || name == names[t][1])
+            return (PLYType) t;
+    return PLY_NONE;
+}
+
+struct PLYProperty {
+    std::string name;
+    PLYType type;      // Of the value, or of the items of a list
+    PLYType countType; // Of the item count of a list, PLY_NONE for a value
+};
+
+struct PLYElement {
+    std::string name;
+    unsigned int count;
+    std::vector<PLYProperty> properties;
+    unsigned int size; // Bytes per record, 0 if they hold lists
+
+    /* Index of the property, -1 if there is none */
+    int find (const char * property) const {
+        for (unsigned int i = 0; i < properties.size (); i++)
+            if (properties[i].name == property)
+                return i;
+        return -1;
+    }
+};
+
+/* Errors of the header name their line, as the ones of TextScanner */
+static void plyError (const std::string & filename, const std::string & what,
+                      unsigned int line = 0) {
+    std::string where = line > 0 ? ":" + std::to_string (line) : "";
+    throw Exception (filename + where + ": " + what);
+}
+
+/* Checks that size bytes are left from c */
+static inline void requirePLY (const char * c, uint64_t size, const char * end,
+                               const std::string & filename) {
+    if ((uint64_t) (end - c) < size)
+        plyError (filename, "truncated file");
+}
+
+/* Value stored at p, whose bytes are reversed when the file and the
+ * machine store them in different orders */
+template <typename T>
+static inline T readPLYRaw (const char * p, bool swap) {
+    char bytes[sizeof (T)];
+    for (unsigned int i = 0; i < sizeof (T); i++)
+        bytes[i] = p[swap ? sizeof (T) - 1 - i : i];
+    T value;
+    memcpy (&value, bytes, sizeof (T));
+    return value;
+}
+
+/* Doubles hold every value of the other types exactly */
+static double readPLYValue (const char * p, PLYType type, bool swap) {
+    switch (type) {
+        case PLY_INT8 : return (int8_t) *p;
+        case PLY_UINT8 : return (uint8_t) *p;
+        case PLY_INT16 : return readPLYRaw<int16_t> (p, swap);
+        case PLY_UINT16 : return readPLYRaw<uint16_t> (p, swap);
+        case PLY_INT32 : return readPLYRaw<int32_t> (p, swap);
+        case PLY_UINT32 : return readPLYRaw<uint32_t> (p, swap);
+        case PLY_FLOAT32 : return readPLYRaw<float> (p, swap);
+        default : return readPLYRaw<double> (p, swap);
+    }
+}
+
+/* Reads the header of a PLY file up to end_header, returns the start of
+ * the body */
+static const char * readPLYHeader (const MappedFile & file,
+                                   const std::string & filename,
+                                   std::vector<PLYElement> & elements,
+                                   bool & swap) {
+    static const bool littleEndian =
+        __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+    const char * c = file.begin ();
+    const char * end = file.end ();
+    bool format = false;
+    for (unsigned int line = 1; ; line++) {
+        if (c == end)
+            plyError (filename, "missing end_header");
+        const char * lineEnd = endOfLine (c, end);
+        std::istringstream words (std::string (c, lineEnd));
+        c = lineEnd + (lineEnd != end);
+
+        std::string word;
+        words >> word;
+        if (line == 1) {
+            if (word != "ply")
+                plyError (filename, "missing PLY header", line);
+        } else if (word == "format") {
+            std::string name;
+            words >> name;
+            if (name == "binary_little_endian")
+                swap = !littleEndian;
+            else if (name == "binary_big_endian")
+                swap = littleEndian;
+            else if (name == "ascii")
+                plyError (filename, "ASCII PLY is not supported, only binary",
+                          line);
+            else
+                plyError (filename, "unknown format " + name, line);
+            format = true;
+        } else if (word == "element") {
+            PLYElement element;
+            long long count = -1;
+            words >> element.name >> count;
+            if (!words || count < 0 || count > 0xffffffffll)
+                plyError (filename, "malformed element", line);
+            element.count = count;
+            elements.push_back (element);
+        } else if (word == "property") {
+            if (elements.empty ())
+                plyError (filename, "property outside of an element", line);
+            PLYProperty property;
+            std::string type;
+            words >> type;
+            if (type == "list") {
+                std::string countType, itemType;
+                words >> countType >> itemType;
+                property.countType = plyType (countType);
+                property.type = plyType (itemType);
+                if (property.countType == PLY_NONE
+                        || property.countType == PLY_FLOAT32
+                        || property.countType == PLY_FLOAT64)
+                    plyError (filename, "bad list count type " + countType,
+                              line);
+            } else {
+                property.countType = PLY_NONE;
+                property.type = plyType (type);
+            }
+            words >> property.name;
+            if (!words || property.type == PLY_NONE)
+                plyError (filename, "malformed property", line);
+            elements.back ().properties.push_back (property);
+        } else if (word == "end_header") {
+            break;
+        }
+        // Comments, obj_info and blank lines are skipped
+    }
+    if (!format)
+        plyError (filename, "missing format");
+
+    for (unsigned int e = 0; e < elements.size (); e++) {
+        PLYElement & element = elements[e];
+        element.size = 0;
+        for (unsigned int i = 0; i < element.properties.size (); i++) {
+            if (element.properties[i].countType != PLY_NONE) {
+                element.size = 0;
+                break;
+            }
+            element.size += plyTypeSizes[element.properties[i].type];
+        }
+    }
+    return c;
+}
+
+/* Passes over a value or a list, returns its end */
+static const char * skipPLYProperty (const PLYProperty & property,
+                                     const char * c, const char * end,
+                                     bool swap, const std::string & filename) {
+    uint64_t size = plyTypeSizes[property.type];
+    if (property.countType != PLY_NONE) {
+        requirePLY (c, plyTypeSizes[property.countType], end, filename);
+        double count = readPLYValue (c, property.countType, swap);
+        if (count < 0)
+            plyError (filename, "negative list size");
+        c += plyTypeSizes[property.countType];
+        size *= (uint64_t) count;
+    }
+    requirePLY (c, size, end, filename);
+    return c + size;
+}
+
+/* Passes over a record holding lists, returns its end */
+static const char * skipPLYRecord (const PLYElement & element, const char * c,
+                                   const char * end, bool swap,
+                                   const std::string & filename) {
+    for (unsigned int i = 0; i < element.properties.size (); i++)
+        c = skipPLYProperty (element.properties[i], c, end, swap, filename);
+    return c;
+}
+
+/* Positions are copied in bulk from records holding only x, y and z as
+ * floats, in the byte order of the machine, else record by record */
+const char * Mesh::loadPLYVertices (const PLYElement & element, const char * c,
+                                    const char * end, bool swap,
+                                    const std::string & filename) {
+    int xyz[3] = {element.find ("x"), element.find ("y"), element.find ("z")};
+    if (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0 || element.size == 0)
+        plyError (filename, "vertices need x, y and z, and no list");
+    requirePLY (c, (uint64_t) element.count * element.size, end, filename);
+
+    unsigned int offsets[3];
+    bool floats = true;
+    for (unsigned int k = 0; k < 3; k++) {
+        offsets[k] = 0;
+        for (int i = 0; i < xyz[k]; i++)
+            offsets[k] += plyTypeSizes[element.properties[i].type];
+        floats = floats && element.properties[xyz[k]].type == PLY_FLOAT32;
+    }
+
+    m_positions.resize (element.count);
+    if (floats && !swap && element.size == sizeof (Vec3f) && offsets[0] == 0
+            && offsets[1] == 4 && offsets[2] == 8) {
+        memcpy ((void *) m_positions.data (), c,
+                element.count * sizeof (Vec3f));
+    } else {
+        for (unsigned int i = 0; i < element.count; i++) {
+            const char * record = c + (uint64_t) i * element.size;
+            for (unsigned int k = 0; k < 3; k++)
+                m_positions[i][k] = floats ?
+                    readPLYRaw<float> (record + offsets[k], swap)
+                    : (float) readPLYValue (record + offsets[k],
+                                            element.properties[xyz[k]].type,
+                                            swap);
+        }
+    }
+    return c + (uint64_t) element.count * element.size;
+}
+
+/* Faces are split in fans, as in OFF files. Triangles of 32 bits indices
+ * are copied as they are, then checked. */
+const char * Mesh::loadPLYFaces (const PLYElement & element, const char * c,
+                                 const char * end, bool swap,
+                                 const std::string & filename) {
+    int list = element.find ("vertex_indices");
+    if (list < 0)
+        list = element.find ("vertex_index");
+    if (list < 0 || element.properties[list].countType == PLY_NONE)
+        plyError (filename, "faces need a vertex_indices list");
+    const PLYProperty & indices = element.properties[list];
+    unsigned int indexSize = plyTypeSizes[indices.type];
+    bool copy = !swap
+        && (indices.type == PLY_INT32 || indices.type == PLY_UINT32);
+    unsigned int sizeV = m_positions.size ();
+
+    m_triangles.reserve (m_triangles.size () + element.count);
+    for (unsigned int f = 0; f < element.count; f++) {
+        for (unsigned int i = 0; i < element.properties.size (); i++) {
+            const PLYProperty & property = element.properties[i];
+            if ((int) i != list) {
+                c = skipPLYProperty (property, c, end, swap, filename);
+                continue;
+            }
+
+            requirePLY (c, plyTypeSizes[property.countType], end, filename);
+            double count = readPLYValue (c, property.countType, swap);
+            c += plyTypeSizes[property.countType];
+            if (count < 3)
+                plyError (filename, "face with less than 3 vertices");
+            unsigned int n = (unsigned int) count;
+            requirePLY (c, (uint64_t) n * indexSize, end, filename);
+
+            if (n == 3 && copy) {
+                Triangle t;
+                memcpy ((void *) &t, c, sizeof (Triangle));
+                if (t[0] >= sizeV || t[1] >= sizeV || t[2] >= sizeV)
+                    plyError (filename, "vertex index out of range");
+                m_triangles.push_back (t);
+                c += sizeof (Triangle);
+                continue;
+            }
+            unsigned int v[3];
+            for (unsigned int j = 0; j < n; j++, c += indexSize) {
+                double index = readPLYValue (c, indices.type, swap);
+                if (index < 0 || index >= sizeV)
+                    plyError (filename, "vertex index out of range");
+                v[std::min (j, 2u)] = (unsigned int) index;
+                if (j >= 2) {
+                    m_triangles.push_back (Triangle (v[0], v[1], v[2]));
+                    v[1] = v[2];
+                }
+            }
+        }
+    }
+    return c;
+}
+
+/* Reads the vertex and face elements, and skips the other ones */
+void Mesh::loadPLY (const std::string & filename) {
+    clear ();
+    MappedFile file (filename);
+    std::vector<PLYElement> elements;
+    bool swap = false;
+    const char * c = readPLYHeader (file, filename, elements, swap);
+    const char * end = file.end ();
+
+    for (unsigned int e = 0; e < elements.size (); e++) {
+        const PLYElement & element = elements[e];
+        if (element.name == "vertex") {
+            c = loadPLYVertices (element, c, end, swap, filename);
+        } else if (element.name == "face") {
+            c = loadPLYFaces (element, c, end, swap, filename);
+        } else if (element.size > 0) {
+            requirePLY (c, (uint64_t) element.count * element.size, end,
+                        filename);
+            c += (uint64_t) element.count * element.size;
+        } else {
+            for (unsigned int i = 0; i < element.count; i++)
+                c = skipPLYRecord (element, c, end, swap, filename);
+        }
+    }
+    if (m_positions.empty ())
+        plyError (filename, "no vertex");
+    finishLoading ();
+}
+
+/* Zero based index of the vertex of a face corner, "v", "v/vt", "v//vn"
+ * or "v/vt/vn", negative indices counting back from the last vertex */
+static unsigned int readOBJCorner (TextScanner & in, const char * token,
+                                   const char * tokenEnd,
+                                   unsigned int vertexCount) {
+    const char * c = token;
+    bool negative = c != tokenEnd && *c == '-';
+    c += negative;
+    const char * digits = c;
+    uint64_t value = 0;
+    while (c != tokenEnd && (unsigned char) (*c - '0') < 10
+           && value <= 0xffffffffu)
+        value = 10 * value + (*c++ - '0');
+    if (c == digits || (c != tokenEnd && *c != '/'))
+        in.error ("malformed face corner");
+
+    int64_t index = negative ? (int64_t) vertexCount - (int64_t) value
+        : (int64_t) value - 1;
+    if (value == 0 || index < 0 || index >= vertexCount)
+        in.error ("vertex index out of range");
+    return (unsigned int) index;
+}
+
+/* Reads the v and f lines of an OBJ file, line by line, and skips the
+ * others: normals, texture coordinates, groups and materials. Faces may
+ * only use the vertices above them. */
+void Mesh::loadOBJ (const std::string & filename) {
+    clear ();
+    MappedFile file (filename);
+    const char * end = file.end ();
+    unsigned int line = 1;
+    for (const char * c = file.begin (); c != end; line++) {
+        const char * lineEnd = endOfLine (c, end);
+        const char * first = c;
+        while (first != lineEnd && (unsigned char) *first <= ' ')
+            first++;
+        if (lineEnd - first > 1 && (first[1] == ' ' || first[1] == '\t')) {
+            TextScanner in (first + 1, lineEnd, filename, line);
+            if (*first == 'v') {
+                Vec3f p;
+                for (unsigned int k = 0; k < 3; k++)
+                    p[k] = in.readFloat ();
+                m_positions.push_back (p);
+            } else if (*first == 'f') {
+                const char * token;
+                const char * tokenEnd;
+                unsigned int v[3];
+                unsigned int n = 0;
+                for (; in.readToken (token, tokenEnd); n++) {
+                    v[std::min (n, 2u)] = readOBJCorner (in, token, tokenEnd,
+                                                         m_positions.size ());
+                    if (n >= 2) {
+                        m_triangles.push_back (Triangle (v[0], v[1], v[2]));
+                        v[1] = v[2];
+                    }
+                }
+                if (n < 3)
+                    in.error ("face with less than 3 vertices");
+            }
+        }
+        c = lineEnd + (lineEnd != end);
+    }
+    if (m_positions.empty ())
+        throw Exception (filename + ": no vertex");
+    finishLoading ();
+}
+
+/* Picks the loader after the extension of the file, OFF by default */
+void Mesh::load (const std::string & filename) {
+    std::string extension = filename.substr (filename.find_last_of ('.') + 1);
+    std::transform (extension.begin (), extension.end (), extension.begin (),
+                    ::tolower);
+    if (extension == "ply")
+        loadPLY (filename);
+    else if (extension == "obj")
+        loadOBJ (filename);
+    else
+        loadOFF (filename);
+}
+
+/* Angle at p of the triangle (p, q, r) */
+static inline float cornerAngle (const Vec3f & p, const Vec3f & q,
+                                 const Vec3f & r) {
+    Vec3f e1 = q - p;
+    Vec3f e2 = r - p;
+    return atan2 (cross (e1, e2).length (), dot (e1, e2));
+}
+
+/* Face normals are computed in parallel, then each vertex gathers the ones
+ * of its triangles, through a vertex to corner adjacency stored in
+ * compressed rows (CSR), one row per vertex. Rows are built without
+ * atomics in two steps. Blocks of triangles, whose size only depends on
+ * the triangle count, first count and then write their corners into the
+ * rows of buckets of NORMALS_BUCKET vertices, at offsets of their own.
+ * The task of a bucket then sorts its corners by vertex, stably, into the
+ * rows of its vertices. Rows thus list their corners in increasing
+ * triangle order, and every vertex sums its face normals in that order,
+ * whatever the thread count, as the serial scatter did. */
+void Mesh::recomputeNormals (bool angleWeighted) {
+    ThreadPool & pool = ThreadPool::instance ();
+    const MeshArray<Vec3f> & positions = m_positions; // Read without a copy
+    const MeshArray<Triangle> & triangles = m_triangles;
+    unsigned int sizeV = m_positions.size ();
+    unsigned int sizeT = m_triangles.size ();
+    unsigned int blockSize = std::max (NORMALS_GRAIN,
+            (sizeT + NORMALS_BLOCKS - 1) / NORMALS_BLOCKS);
+    unsigned int blocks = (sizeT + blockSize - 1) / blockSize;
+    unsigned int buckets = sizeV / NORMALS_BUCKET + 1;
+
+    /* Corners are numbered 3 * triangle + j, so that the angles of the
+     * triangles line up with them */
+    std::vector<Vec3f> faceNormals (sizeT);
+    std::vector<float> angles (angleWeighted ? 3 * sizeT : 0);
+    std::vector<unsigned int> offsets ((size_t) blocks * buckets, 0);
+    pool.parallelFor (0, blocks, 1, [&] (unsigned int begin, unsigned int end) {
+        for (unsigned int b = begin; b < end; b++) {
+            unsigned int * counts = &offsets[(size_t) b * buckets];
+            unsigned int last = std::min (sizeT, (b + 1) * blockSize);
+            for (unsigned int i = b * blockSize; i < last; i++) {
+                const Triangle & t = triangles[i];
+                Vec3f e01 = positions[t[1]] - positions[t[0]];
+                Vec3f e02 = positions[t[2]] - positions[t[0]];
+                faceNormals[i] = cross (e01, e02);
+                faceNormals[i].normalize ();
+                for (unsigned int j = 0; j < 3; j++) {
+                    counts[t[j] / NORMALS_BUCKET]++;
+                    if (angleWeighted)
+                        angles[3 * i + j] = cornerAngle (positions[t[j]],
+                                positions[t[(j + 1) % 3]],
+                                positions[t[(j + 2) % 3]]);
+                }
+            }
+        }
+    });
+
+    /* Each row holds the corners of the first block, then of the second
+     * one, and so on */
+    std::vector<unsigned int> rows (buckets + 1);
+    unsigned int sum = 0;
+    for (unsigned int k = 0; k < buckets; k++) {
+        rows[k] = sum;
+        for (unsigned int b = 0; b < blocks; b++) {
+            unsigned int count = offsets[(size_t) b * buckets + k];
+            offsets[(size_t) b * buckets + k] = sum;
+            sum += count;
+        }
+    }
+    rows[buckets] = sum;
+
+    /* Corners are listed with their vertex, which the buckets sort by */
+    std::vector<unsigned int> corners (sum);
+    std::vector<unsigned int> cornerVertices (sum);
+    pool.parallelFor (0, blocks, 1, [&] (unsigned int begin, unsigned int end) {
+        for (unsigned int b = begin; b < end; b++) {
+            unsigned int * cursors = &offsets[(size_t) b * buckets];
+            unsigned int last = std::min (sizeT, (b + 1) * blockSize);
+            for (unsigned int i = b * blockSize; i < last; i++) {
+                for (unsigned int j = 0; j < 3; j++) {
+                    unsigned int v = triangles[i][j];
+                    unsigned int c = cursors[v / NORMALS_BUCKET]++;
+                    corners[c] = 3 * i + j;
+                    cornerVertices[c] = v;
+                }
+            }
+        }
+    });
+
+    /* Each bucket sorts its corners into the rows of its vertices, then
+     * each of them sums its own row */
+    m_normals.resize (sizeV);
+    pool.parallelFor (0, buckets, 1, [&] (unsigned int begin, unsigned int end) {
+        std::vector<unsigned int> vertexRows (NORMALS_BUCKET + 1);
+        std::vector<unsigned int> vertexCorners;
+        for (unsigned int k = begin; k < end; k++) {
+            unsigned int first = k * NORMALS_BUCKET;
+            unsigned int last = std::min (sizeV, first + NORMALS_BUCKET);
+            std::fill (vertexRows.begin (), vertexRows.end (), 0);
+            for (unsigned int c = rows[k]; c < rows[k + 1]; c++)
+                vertexRows[cornerVertices[c] - first + 1]++;
+            for (unsigned int v = first; v < last; v++)
+                vertexRows[v - first + 1] += vertexRows[v - first];
+            vertexCorners.resize (rows[k + 1] - rows[k]);
+            for (unsigned int c = rows[k]; c < rows[k + 1]; c++)
+                vertexCorners[vertexRows[cornerVertices[c] - first]++] =
+                    corners[c];
+
+            /* Placing the corners moved each row start to the next one */
+            unsigned int row = 0;
+            for (unsigned int v = first; v < last; v++) {
+                Vec3f n (0.f, 0.f, 0.f);
+                for (; row < vertexRows[v - first]; row++) {
+                    unsigned int corner = vertexCorners[row];
+                    n += angleWeighted
+                        ? faceNormals[corner / 3] * angles[corner]
+                        : faceNormals[corner / 3];
+                }
+                n.normalize ();
+                m_normals[v] = n;
+            }
+        }
+    });
 }
 
 void Mesh::centerAndScaleToUnit () {
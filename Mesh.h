@@ -14,6 +14,10 @@
 #include <vector>
 #include "Vec3.h"
 #include "Triangle.h"
+#include "MeshArray.h"
+
+class TextScanner;
+struct PLYElement;
 
 /// A Mesh class, storing a list of vertices and a list of triangles indexed over it.
 class Mesh {
@@ -21,12 +25,14 @@ public:
     inline Mesh () {}
     inline virtual ~Mesh () {}
 
-    inline std::vector<Vec3f> & positions () { return m_positions; }
-    inline const std::vector<Vec3f> & positions () const { return m_positions; }
-    inline  std::vector<Vec3f> & normals () { return m_normals; }
-    inline const std::vector<Vec3f> & normals () const { return m_normals; }
-    inline std::vector<Triangle> triangles () { return m_triangles; }
-    inline const std::vector<Triangle> & triangles () const { return m_triangles; }
+    /// Arrays may be views over a mapped MeshCache file, copied on the
+    /// first change: read them through the const accessors.
+    inline MeshArray<Vec3f> & positions () { return m_positions; }
+    inline const MeshArray<Vec3f> & positions () const { return m_positions; }
+    inline  MeshArray<Vec3f> & normals () { return m_normals; }
+    inline const MeshArray<Vec3f> & normals () const { return m_normals; }
+    inline MeshArray<Triangle> & triangles () { return m_triangles; }
+    inline const MeshArray<Triangle> & triangles () const { return m_triangles; }
 
     /// Empty the positions, normals and triangles arrays.
     void clear ();
@@ -34,14 +40,45 @@ public:
 	/// Loads the mesh from a <file>.off
 	void loadOFF (const std::string & filename);
 
-    /// Compute smooth per-vertex normals
-    void recomputeNormals ();
+    /// Loads the mesh from a binary <file>.ply, of either byte order
+    void loadPLY (const std::string & filename);
+
+    /// Loads the mesh from a <file>.obj
+    void loadOBJ (const std::string & filename);
+
+    /// Loads the mesh with the loader of the file's extension, OFF by default
+    void load (const std::string & filename);
+
+    /// Reads the keyword starting an OFF file: OFF, or a variant such as
+    /// COFF, NOFF, CNOFF or STOFF, whose vertices carry colors, normals or
+    /// texture coordinates after their position, then the dimension of
+    /// the nOFF ones. Returns whether the vertices may carry such fields.
+    static bool readOFFHeader (TextScanner & in);
+
+    /// Compute smooth per-vertex normals, the mean of the normals of the
+    /// triangles around each vertex, weighted by their angle at the vertex
+    /// if angleWeighted. Runs on the thread pool, with the same result
+    /// whatever the thread count.
+    void recomputeNormals (bool angleWeighted = false);
 
     /// scale to the unit cube and center at original
     void centerAndScaleToUnit ();
 
 private:
-    std::vector<Vec3f> m_positions;
-    std::vector<Vec3f> m_normals;
-    std::vector<Triangle> m_triangles;
+    void loadOFFSequential (TextScanner & in, unsigned int sizeV,
+                            unsigned int sizeT, bool vertexFields);
+    bool loadOFFParallel (const std::string & filename, const char * body,
+                          const char * end, unsigned int firstLine,
+                          unsigned int sizeV, unsigned int sizeT);
+    const char * loadPLYVertices (const PLYElement & element, const char * c,
+                                  const char * end, bool swap,
+                                  const std::string & filename);
+    const char * loadPLYFaces (const PLYElement & element, const char * c,
+                               const char * end, bool swap,
+                               const std::string & filename);
+    void finishLoading ();
+
+    MeshArray<Vec3f> m_positions;
+    MeshArray<Vec3f> m_normals;
+    MeshArray<Triangle> m_triangles;
 };
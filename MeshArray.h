@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/* An array of a Mesh: either a vector of its own, or a view over values
+ * owned by something else, such as a mapped MeshCache file, which backing
+ * keeps alive. Reading a view costs nothing. Any change first copies it
+ * into a vector of its own, so that a view is never written through:
+ * read it through a const reference to avoid that copy. */
+template <typename T>
+class MeshArray {
+    private :
+        std::vector<T> owned;
+        const T *view; // NULL unless the array is a view
+        size_t viewSize;
+        std::shared_ptr<const void> backing;
+
+        void detach() {
+            if (view == NULL)
+                return;
+            owned.assign(view, view + viewSize);
+            dropView();
+        }
+
+        void dropView() {
+            view = NULL;
+            viewSize = 0;
+            backing.reset();
+        }
+
+    public :
+        typedef T value_type;
+
+        MeshArray() : view(NULL), viewSize(0) {}
+
+        /* Makes the array a view over the count values at values */
+        void setView(const T *values, size_t count,
+                     const std::shared_ptr<const void> &_backing) {
+            std::vector<T>().swap(owned);
+            view = values;
+            viewSize = count;
+            backing = _backing;
+        }
+        bool isView() const {return view != NULL;}
+
+        size_t size() const {return view != NULL ? viewSize : owned.size();}
+        bool empty() const {return size() == 0;}
+        const T * data() const {return view != NULL ? view : owned.data();}
+        const T * begin() const {return data();}
+        const T * end() const {return data() + size();}
+        const T & operator[](size_t i) const {return data()[i];}
+
+        T * data() {detach(); return owned.data();}
+        T * begin() {return data();}
+        T * end() {return data() + owned.size();}
+        T & operator[](size_t i) {detach(); return owned[i];}
+
+        void resize(size_t count) {detach(); owned.resize(count);}
+        void reserve(size_t count) {detach(); owned.reserve(count);}
+        void push_back(const T &value) {detach(); owned.push_back(value);}
+        void assign(size_t count, const T &value) {
+            dropView();
+            owned.assign(count, value);
+        }
+
+        /* Also releases the memory, or the view */
+        void clear() {
+            dropView();
+            std::vector<T>().swap(owned);
+        }
+};
@@ -0,0 +1,304 @@
+#include "MeshCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "Exception.h"
+
+#define MESH_CACHE_MAGIC "IGRMESH"
+#define MESH_CACHE_VERSION 3
+#define MESH_CACHE_ALIGNMENT 64 // Of every array in the file
+
+enum MeshCacheSection {
+    SECTION_POSITIONS,   // Vec3f per vertex
+    SECTION_NORMALS,     // Vec3f per vertex
+    SECTION_TRIANGLES,   // Triangle per triangle
+    SECTION_BVH_NODES,   // BVHNode, in depth-first order
+    SECTION_BVH_INDEXES, // int per triangle, in the order of the leaves
+    SECTION_VERTEX_IDS,  // uint32_t per vertex, optional
+    SECTION_WIDE_NODES,  // WideNode, the root first, optional
+    SECTION_WIDE_BLOCKS, // TriangleBlock, optional
+    SECTION_COUNT
+};
+
+/* Layout of the file: the header, then the arrays it points to */
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t wideWidth; // Of the wide BVH, 0 if there is none
+    uint64_t modelSize;
+    int64_t modelTime;
+    uint64_t offset[SECTION_COUNT]; // Bytes from the start of the file
+    uint64_t count[SECTION_COUNT];  // Elements, 0 if the array is absent
+};
+
+void MeshCache::open(const std::string &_modelFilename,
+        const std::string &cacheFilename) {
+    modelFilename = _modelFilename;
+    filename = cacheFilename.empty() ? modelFilename + ".mesh"
+        : cacheFilename;
+    file.reset();
+    if (!readStamp())
+        return;
+
+    try {
+        /* Meshes are read in place, by rays in any order */
+        file.reset(new MappedFile(filename, MappedFile::ACCESS_NORMAL));
+    } catch (Exception &) {
+        return; // No cache yet
+    }
+
+    MeshCacheHeader header;
+    if (file->getSize() < sizeof(header)) {
+        file.reset();
+        return;
+    }
+    memcpy(&header, file->begin(), sizeof(header));
+    if (memcmp(header.magic, MESH_CACHE_MAGIC, 8) != 0
+            || header.version != MESH_CACHE_VERSION
+            || header.modelSize != modelSize
+            || header.modelTime != modelTime)
+        file.reset();
+}
+
+bool MeshCache::readStamp() {
+    return MappedFile::stamp(modelFilename, modelSize, modelTime);
+}
+
+/* The array of the section if it holds count elements within the file,
+ * else NULL */
+const char * MeshCache::section(unsigned int type, uint64_t count,
+        size_t elementSize) const {
+    const MeshCacheHeader *header = (const MeshCacheHeader *) file->begin();
+    uint64_t offset = header->offset[type];
+    if (count == 0 || header->count[type] != count
+            || offset % MESH_CACHE_ALIGNMENT != 0
+            || offset > file->getSize()
+            || count > (file->getSize() - offset) / elementSize)
+        return NULL;
+    return file->begin() + offset;
+}
+
+bool MeshCache::loadMesh(Mesh &mesh) const {
+    if (!file)
+        return false;
+
+    const MeshCacheHeader *header = (const MeshCacheHeader *) file->begin();
+    uint64_t vertexCount = header->count[SECTION_POSITIONS];
+    uint64_t triangleCount = header->count[SECTION_TRIANGLES];
+    const char *positions = section(SECTION_POSITIONS, vertexCount,
+            sizeof(Vec3f));
+    const char *normals = section(SECTION_NORMALS, vertexCount,
+            sizeof(Vec3f));
+    const char *triangles = section(SECTION_TRIANGLES, triangleCount,
+            sizeof(Triangle));
+    if (positions == NULL || normals == NULL || triangles == NULL
+            || vertexCount > 0xffffffffu)
+        return false;
+
+    /* Indices are checked, as the tracers trust them */
+    const Triangle *t = (const Triangle *) triangles;
+    for (uint64_t i = 0; i < triangleCount; i++)
+        for (unsigned int j = 0; j < 3; j++)
+            if (t[i][j] >= vertexCount)
+                return false;
+
+    mesh.clear();
+    mesh.positions().setView((const Vec3f *) positions, vertexCount, file);
+    mesh.normals().setView((const Vec3f *) normals, vertexCount, file);
+    mesh.triangles().setView(t, triangleCount, file);
+    return true;
+}
+
+bool MeshCache::loadVertexIds(std::vector<uint32_t> &vertexIds) const {
+    if (!file)
+        return false;
+
+    const MeshCacheHeader *header = (const MeshCacheHeader *) file->begin();
+    uint64_t vertexCount = header->count[SECTION_POSITIONS];
+    const char *ids = section(SECTION_VERTEX_IDS, vertexCount,
+            sizeof(uint32_t));
+    if (ids == NULL)
+        return false;
+
+    vertexIds.resize(vertexCount);
+    memcpy(&vertexIds[0], ids, vertexCount * sizeof(uint32_t));
+    return true;
+}
+
+BVH * MeshCache::loadBVH(const Mesh &mesh) const {
+    if (!file)
+        return NULL;
+
+    const MeshCacheHeader *header = (const MeshCacheHeader *) file->begin();
+    uint64_t nodeCount = header->count[SECTION_BVH_NODES];
+    uint64_t indexCount = mesh.triangles().size();
+    const BVHNode *nodes = (const BVHNode *) section(SECTION_BVH_NODES,
+            nodeCount, sizeof(BVHNode));
+    const int *indexes = (const int *) section(SECTION_BVH_INDEXES,
+            indexCount, sizeof(int));
+    if (nodes == NULL || indexes == NULL)
+        return NULL;
+
+    /* Children must follow their parent within the array, leaves within
+     * the indexes, and no path may outgrow the traversal stacks */
+    std::vector<unsigned char> depth(nodeCount, 0);
+    for (uint64_t i = 0; i < nodeCount; i++) {
+        const BVHNode &node = nodes[i];
+        if (node.isLeaf()) {
+            if (node.offset + (uint64_t) node.count > indexCount)
+                return NULL;
+            continue;
+        }
+        if (i + 1 >= nodeCount || node.offset <= i + 1
+                || node.offset >= nodeCount || depth[i] + 1 >= BVH_STACK_SIZE)
+            return NULL;
+        depth[i + 1] = depth[node.offset] = depth[i] + 1;
+    }
+    for (uint64_t i = 0; i < indexCount; i++)
+        if (indexes[i] < 0 || (uint64_t) indexes[i] >= indexCount)
+            return NULL;
+
+    std::vector<BVHNode> nodeArray(nodes, nodes + nodeCount);
+    std::vector<int> indexArray(indexes, indexes + indexCount);
+    return new BVH(mesh, nodeArray, indexArray);
+}
+
+WideBVH<BVH_WIDTH> * MeshCache::loadWideBVH(const Mesh &mesh) const {
+    if (!file)
+        return NULL;
+
+    typedef WideNode<BVH_WIDTH> Node;
+    typedef TriangleBlock<BVH_WIDTH> Block;
+    const MeshCacheHeader *header = (const MeshCacheHeader *) file->begin();
+    uint64_t nodeCount = header->count[SECTION_WIDE_NODES];
+    uint64_t blockCount = header->count[SECTION_WIDE_BLOCKS];
+    uint64_t triangleCount = mesh.triangles().size();
+    const Node *nodes = (const Node *) section(SECTION_WIDE_NODES,
+            nodeCount, sizeof(Node));
+    const Block *blocks = (const Block *) section(SECTION_WIDE_BLOCKS,
+            blockCount, sizeof(Block));
+    if (header->wideWidth != BVH_WIDTH || nodes == NULL || blocks == NULL)
+        return NULL;
+
+    /* Children must follow their parent, leaves lie within the blocks, no
+     * path may outgrow the traversal stacks, and lanes without a triangle
+     * must not be hit */
+    std::vector<unsigned char> depth(nodeCount, 0);
+    for (uint64_t i = 0; i < nodeCount; i++) {
+        const Node &node = nodes[i];
+        if (node.childCount == 0 || node.childCount > BVH_WIDTH)
+            return NULL;
+        for (unsigned int c = 0; c < node.childCount; c++) {
+            if (node.count[c] > 0) {
+                if (node.offset[c] + (uint64_t) (node.count[c]
+                        + BVH_WIDTH - 1) / BVH_WIDTH > blockCount)
+                    return NULL;
+                continue;
+            }
+            if (node.offset[c] <= i || node.offset[c] >= nodeCount
+                    || depth[i] + 1 >= BVH_STACK_SIZE)
+                return NULL;
+            depth[node.offset[c]] = depth[i] + 1;
+        }
+    }
+    for (uint64_t b = 0; b < blockCount; b++) {
+        const Block &block = blocks[b];
+        for (int lane = 0; lane < BVH_WIDTH; lane++) {
+            if (block.triangle[lane] >= 0) {
+                if ((uint64_t) block.triangle[lane] >= triangleCount)
+                    return NULL;
+                continue;
+            }
+            if (block.triangle[lane] != -1
+                    || block.e0X[lane] != 0.f || block.e0Y[lane] != 0.f
+                    || block.e0Z[lane] != 0.f || block.e1X[lane] != 0.f
+                    || block.e1Y[lane] != 0.f || block.e1Z[lane] != 0.f)
+                return NULL;
+        }
+    }
+
+    std::vector<Node> nodeArray(nodes, nodes + nodeCount);
+    std::vector<Block> blockArray(blocks, blocks + blockCount);
+    return new WideBVH<BVH_WIDTH>(mesh, nodeArray, blockArray);
+}
+
+bool MeshCache::save(const Mesh &mesh, const BVH *bvh,
+        const std::vector<uint32_t> *vertexIds,
+        const WideBVH<BVH_WIDTH> *wideBVH) {
+    if (filename.empty() || !readStamp())
+        return false;
+
+    const void *arrays[SECTION_COUNT] = {
+        mesh.positions().data(), mesh.normals().data(),
+        mesh.triangles().data(),
+        bvh ? bvh->getNodes().data() : NULL,
+        bvh ? bvh->getIndexes().data() : NULL,
+        vertexIds ? vertexIds->data() : NULL,
+        wideBVH ? wideBVH->getNodes().data() : NULL,
+        wideBVH ? wideBVH->getBlocks().data() : NULL
+    };
+    size_t sizes[SECTION_COUNT] = {
+        sizeof(Vec3f), sizeof(Vec3f), sizeof(Triangle),
+        sizeof(BVHNode), sizeof(int), sizeof(uint32_t),
+        sizeof(WideNode<BVH_WIDTH>), sizeof(TriangleBlock<BVH_WIDTH>)
+    };
+
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, 8);
+    header.version = MESH_CACHE_VERSION;
+    header.modelSize = modelSize;
+    header.modelTime = modelTime;
+    header.count[SECTION_POSITIONS] = mesh.positions().size();
+    header.count[SECTION_NORMALS] = mesh.normals().size();
+    header.count[SECTION_TRIANGLES] = mesh.triangles().size();
+    if (bvh != NULL) {
+        header.count[SECTION_BVH_NODES] = bvh->getNodes().size();
+        header.count[SECTION_BVH_INDEXES] = bvh->getIndexes().size();
+    }
+    if (vertexIds != NULL)
+        header.count[SECTION_VERTEX_IDS] = vertexIds->size();
+    if (wideBVH != NULL) {
+        header.wideWidth = BVH_WIDTH;
+        header.count[SECTION_WIDE_NODES] = wideBVH->getNodes().size();
+        header.count[SECTION_WIDE_BLOCKS] = wideBVH->getBlocks().size();
+    }
+
+    uint64_t offset = sizeof(header);
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        offset = (offset + MESH_CACHE_ALIGNMENT - 1)
+            / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+        header.offset[s] = offset;
+        offset += header.count[s] * sizes[s];
+    }
+
+    /* Written aside then renamed, so that an interrupted write never
+     * leaves a truncated cache behind */
+    std::string partial = filename + ".part";
+    std::ofstream out(partial.c_str(), std::ios::binary);
+    out.write((const char *) &header, sizeof(header));
+    static const char zeros[MESH_CACHE_ALIGNMENT] = {0};
+    uint64_t written = sizeof(header);
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        if (header.count[s] == 0)
+            continue;
+        out.write(zeros, header.offset[s] - written);
+        out.write((const char *) arrays[s], header.count[s] * sizes[s]);
+        written = header.offset[s] + header.count[s] * sizes[s];
+    }
+    out.close();
+
+    if (!out || rename(partial.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Could not write the mesh cache " << filename
+            << std::endl;
+        remove(partial.c_str());
+        return false;
+    }
+
+    /* Maps the new file, so that it serves the next loads */
+    open(modelFilename, filename);
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Mesh.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "MappedFile.h"
+
+/* The mesh as it is after loading, centered and with its normals, saved
+ * next to the model in <model>.mesh, along with its default BVH once it
+ * has been built. Other files, such as the chunks of a ChunkedMesh, may
+ * also hold the wide BVH collapsed from it. Arrays lie aligned in the
+ * file, which is mapped and read in place by the mesh, so that nothing
+ * is parsed, recomputed nor copied.
+ * The file records the size and modification time of the model it comes
+ * from, and is ignored once the model changes. Values are stored in the
+ * byte order of the machine. A missing or broken cache only means
+ * loading the model again. */
+class MeshCache {
+    public :
+        /* Binds the cache to the model, and maps its file if it is up to
+         * date. The file defaults to <model>.mesh. */
+        void open(const std::string &_modelFilename,
+                  const std::string &cacheFilename = "");
+
+        /* Makes the arrays of the mesh views over the ones of the cache,
+         * which stay mapped for as long as the mesh uses them */
+        bool loadMesh(Mesh &mesh) const;
+
+        /* The BVH saved with the mesh, NULL if there is none. The mesh
+         * must come from loadMesh. */
+        BVH * loadBVH(const Mesh &mesh) const;
+
+        /* The wide BVH saved with the mesh, NULL if there is none or if it
+         * is not BVH_WIDTH wide. The mesh must come from loadMesh. */
+        WideBVH<BVH_WIDTH> * loadWideBVH(const Mesh &mesh) const;
+
+        /* Indices the vertices of the mesh have in a larger one, when it
+         * is a part of it, such as a chunk of a ChunkedMesh */
+        bool loadVertexIds(std::vector<uint32_t> &vertexIds) const;
+
+        /* Rewrites the file with the mesh, and the BVH, vertex ids and
+         * wide BVH if not NULL. Returns false if it could not be
+         * written. */
+        bool save(const Mesh &mesh, const BVH *bvh,
+                  const std::vector<uint32_t> *vertexIds = NULL,
+                  const WideBVH<BVH_WIDTH> *wideBVH = NULL);
+
+    private :
+        std::string modelFilename;
+        std::string filename;
+        uint64_t modelSize;
+        int64_t modelTime; // Modification time, in nanoseconds
+        std::shared_ptr<const MappedFile> file; // NULL if there is no valid cache
+
+        bool readStamp();
+        const char * section(unsigned int type, uint64_t count,
+                             size_t elementSize) const;
+};
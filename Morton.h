@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "Vec3.h"
+
+/* Spreads the 10 low bits of v so that two zero bits separate each */
+inline unsigned int expandBits(unsigned int v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/* 30 bits Morton code of p, quantized on a 1024^3 grid over [low, upp] */
+inline unsigned int mortonCode(const Vec3f &p, const Vec3f &low,
+                               const Vec3f &upp) {
+    unsigned int code = 0;
+    for (int k = 0; k < 3; k++) {
+        float extent = upp[k] - low[k];
+        float x = extent > 0.f ? (p[k] - low[k]) / extent : 0.f;
+        unsigned int q = (unsigned int) std::min(std::max(x * 1024.f, 0.f),
+                                                 1023.f);
+        code |= expandBits(q) << (2 - k);
+    }
+    return code;
+}
+
+/* Sorts indices by their 30 bits codes, in three 10 bits LSD radix passes.
+ * The sort is stable, equal codes keep their relative order. */
+inline void radixSortMorton(std::vector<unsigned int> &codes,
+                            std::vector<int> &indices) {
+    std::vector<unsigned int> tmpCodes(codes.size());
+    std::vector<int> tmpIndices(indices.size());
+    std::vector<unsigned int> histogram(1024);
+
+    for (int shift = 0; shift < 30; shift += 10) {
+        std::fill(histogram.begin(), histogram.end(), 0);
+        for (unsigned int i = 0; i < codes.size(); i++)
+            histogram[(codes[i] >> shift) & 1023] ++;
+
+        unsigned int sum = 0;
+        for (unsigned int b = 0; b < 1024; b++) {
+            unsigned int count = histogram[b];
+            histogram[b] = sum;
+            sum += count;
+        }
+
+        for (unsigned int i = 0; i < codes.size(); i++) {
+            unsigned int dst = histogram[(codes[i] >> shift) & 1023] ++;
+            tmpCodes[dst] = codes[i];
+            tmpIndices[dst] = indices[i];
+        }
+
+        codes.swap(tmpCodes);
+        indices.swap(tmpIndices);
+    }
+}
+
+/* Indices of the points, any array of Vec3f, sorted along the Morton
+ * curve of their bounding box, so that consecutive points are close in
+ * space */
+template <typename Points>
+inline std::vector<int> mortonOrder(const Points &points) {
+    std::vector<int> indices(points.size());
+    if (points.empty())
+        return indices;
+
+    Vec3f low = points[0];
+    Vec3f upp = points[0];
+    for (unsigned int i = 1; i < points.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            low[k] = std::min(low[k], points[i][k]);
+            upp[k] = std::max(upp[k], points[i][k]);
+        }
+    }
+
+    std::vector<unsigned int> codes(points.size());
+    for (unsigned int i = 0; i < points.size(); i++) {
+        codes[i] = mortonCode(points[i], low, upp);
+        indices[i] = i;
+    }
+    radixSortMorton(codes, indices);
+    return indices;
+}
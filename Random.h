@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+
+/* SplitMix64 finalizer, a bijection with good avalanche */
+inline uint64_t splitMix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/* Counter-based random numbers: the n-th value of a stream is a hash of
+ * (seed, stream, n), so any stream can be drawn by any thread and gives
+ * the same values whatever the order streams are processed in. */
+class CounterRNG {
+    private :
+        uint64_t key;
+        uint64_t counter;
+
+    public :
+        CounterRNG(uint64_t seed, uint64_t stream) :
+            key(splitMix64(splitMix64(seed)
+                        ^ (stream + 0x9E3779B97F4A7C15ull))),
+            counter(0) {}
+
+        /* Jumps over the next n values, in constant time */
+        void skip(uint64_t n) {counter += n;}
+
+        uint32_t nextUInt() {
+            return splitMix64(key + 0x9E3779B97F4A7C15ull * ++counter) >> 32;
+        }
+
+        /* Uniform in [0, 1), on the 24 bits a float holds */
+        float nextFloat() {
+            return (nextUInt() >> 8) * (1.f / 16777216.f);
+        }
+
+        /* Uniform in [low, upp) */
+        float nextFloat(float low, float upp) {
+            return low + (upp - low) * nextFloat();
+        }
+};
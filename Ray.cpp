@@ -8,19 +8,33 @@ Ray::Ray()
 {
 	origin = Vec3f(0.0, 0.0, 0.0);
 	direction = Vec3f(1.0, 1.0, 1.0);
+	tmin = RAY_EPSILON;
+	tmax = FLT_MAX;
+	precompute();
 }
 
-Ray::Ray(Vec3f _origin, Vec3f _direction)
+Ray::Ray(Vec3f _origin, Vec3f _direction, float _tmin, float _tmax)
 {
 	origin = _origin;
 	direction = _direction;
+	tmin = _tmin;
+	tmax = _tmax;
+	precompute();
 }
 
-bool Ray::rayTriangleInter(Vec3f p0, Vec3f p1, Vec3f p2)
+void Ray::precompute()
+{
+	for (int k = 0; k < 3; k++) {
+		invDirection[k] = 1.f / direction[k];
+		sign[k] = std::signbit(invDirection[k]) ? 1 : 0;
+	}
+}
+
+bool Ray::rayTriangleInter(const Vec3f &p0, const Vec3f &p1,
+		const Vec3f &p2) const
 {
 	Vec3f e0 = p1 - p0;
 	Vec3f e1 = p2 - p0;
-	Vec3f n = normalize(cross(e0, e1));
 	Vec3f q = cross(direction, e1);
 	float a = dot(e0, q);
 
@@ -39,14 +53,14 @@ bool Ray::rayTriangleInter(Vec3f p0, Vec3f p1, Vec3f p2)
 		return false;
 
 	float t = dot(e1, r);
-    return(t > EPSILON);
+    return(t > tmin && t < tmax);
 }
 
-float Ray::rayTriangleInterDist(Vec3f p0, Vec3f p1, Vec3f p2)
+float Ray::rayTriangleInterDist(const Vec3f &p0, const Vec3f &p1,
+		const Vec3f &p2) const
 {
 	Vec3f e0 = p1 - p0;
 	Vec3f e1 = p2 - p0;
-	Vec3f n = normalize(cross(e0, e1));
 	Vec3f q = cross(direction, e1);
 	float a = dot(e0, q);
 
@@ -67,3 +81,31 @@ float Ray::rayTriangleInterDist(Vec3f p0, Vec3f p1, Vec3f p2)
 	float t = dot(e1, r);
     return(t);
 }
+
+bool Ray::rayTriangleInter(const Vec3f &p0, const Vec3f &p1, const Vec3f &p2,
+		float &t, float &u, float &v) const
+{
+	Vec3f e0 = p1 - p0;
+	Vec3f e1 = p2 - p0;
+	Vec3f q = cross(direction, e1);
+	float a = dot(e0, q);
+
+	if (std::abs(a) < EPSILON)
+		return false;
+
+	Vec3f s = (origin - p0) / a;
+	Vec3f r = cross(s, e0);
+	float b0 = dot(s, q);
+	float b1 = dot(r, direction);
+
+	if (b0 < 0.0 || b0 > 1.0)
+		return false;
+
+	if (b1 < 0.0 || b0 + b1 > 1.0)
+		return false;
+
+	t = dot(e1, r);
+	u = b0;
+	v = b1;
+	return (t > tmin && t < tmax);
+}
@@ -2,15 +2,49 @@
 
 #include "Vec3.h"
 #include <vector>
+#include <cfloat>
 
+/* Default start of a ray, which keeps it from hitting the surface it
+ * leaves */
+#define RAY_EPSILON 0.0001f
+
+/* Closest intersection found along a ray. u and v are the barycentric
+ * weights of the triangle's second and third vertices. */
+struct Hit {
+	float t;
+	int triangle;
+	float u;
+	float v;
+
+	Hit() : t(FLT_MAX), triangle(-1), u(0.f), v(0.f) {}
+	bool found() const {return triangle >= 0;}
+};
+
+/* Segment origin + t * direction, for t in ]tmin, tmax[. The reciprocal
+ * direction and its signs are kept for the slab tests of the traversals. */
 class Ray {
 private :
 	Vec3f origin;
 	Vec3f direction;
+	Vec3f invDirection; // Infinite along the axes the ray runs parallel to
+	int sign[3]; // 1 where the direction is negative
+	float tmin;
+	float tmax;
+
+	void precompute();
 
 public :
 	Ray();
-	Ray(Vec3f, Vec3f);
-	bool rayTriangleInter(Vec3f, Vec3f, Vec3f);
-	float rayTriangleInterDist(Vec3f, Vec3f, Vec3f);
+	Ray(Vec3f, Vec3f, float tmin = RAY_EPSILON, float tmax = FLT_MAX);
+	const Vec3f & getOrigin() const {return origin;}
+	const Vec3f & getDirection() const {return direction;}
+	const Vec3f & getInvDirection() const {return invDirection;}
+	int getSign(int axis) const {return sign[axis];}
+	float getTMin() const {return tmin;}
+	float getTMax() const {return tmax;}
+	bool rayTriangleInter(const Vec3f &, const Vec3f &, const Vec3f &) const;
+	float rayTriangleInterDist(const Vec3f &, const Vec3f &,
+	                           const Vec3f &) const;
+	bool rayTriangleInter(const Vec3f &, const Vec3f &, const Vec3f &,
+	                      float &t, float &u, float &v) const;
 };
@@ -0,0 +1,215 @@
+#include "RayPacket.h"
+
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+#define EPSILON 0.0001f
+
+unsigned int RayPacket::add(const Ray &ray, int ignored) {
+    unsigned int lane = size++;
+    const Vec3f &o = ray.getOrigin();
+    const Vec3f &d = ray.getDirection();
+    const Vec3f &inv = ray.getInvDirection();
+
+    ox[lane] = o[0];
+    oy[lane] = o[1];
+    oz[lane] = o[2];
+    dx[lane] = d[0];
+    dy[lane] = d[1];
+    dz[lane] = d[2];
+
+    /* Huge values instead of infinities, so that slabs never get 0 * inf */
+    ix[lane] = std::isinf(inv[0]) ? std::copysign(1e30f, inv[0]) : inv[0];
+    iy[lane] = std::isinf(inv[1]) ? std::copysign(1e30f, inv[1]) : inv[1];
+    iz[lane] = std::isinf(inv[2]) ? std::copysign(1e30f, inv[2]) : inv[2];
+
+    tmin[lane] = ray.getTMin();
+    tmax[lane] = ray.getTMax();
+    ignoredVertex[lane] = ignored;
+    return lane;
+}
+
+void RayPacket::finalize() {
+    /* Unused lanes repeat the first ray, so that SIMD loops can run over
+     * the whole packet without polluting the results */
+    for (unsigned int lane = size; lane < RAY_PACKET_SIZE; lane++) {
+        ox[lane] = ox[0]; oy[lane] = oy[0]; oz[lane] = oz[0];
+        dx[lane] = dx[0]; dy[lane] = dy[0]; dz[lane] = dz[0];
+        ix[lane] = ix[0]; iy[lane] = iy[0]; iz[lane] = iz[0];
+        tmin[lane] = tmin[0];
+        tmax[lane] = tmax[0];
+        ignoredVertex[lane] = ignoredVertex[0];
+    }
+
+    originLow = invLow = Vec3f(FLT_MAX, FLT_MAX, FLT_MAX);
+    originUpp = invUpp = Vec3f(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    intervalValid = size > 0;
+
+    for (unsigned int lane = 0; lane < size; lane++) {
+        float o[3] = {ox[lane], oy[lane], oz[lane]};
+        float inv[3] = {ix[lane], iy[lane], iz[lane]};
+        for (int k = 0; k < 3; k++) {
+            originLow[k] = std::min(originLow[k], o[k]);
+            originUpp[k] = std::max(originUpp[k], o[k]);
+            invLow[k] = std::min(invLow[k], inv[k]);
+            invUpp[k] = std::max(invUpp[k], inv[k]);
+        }
+    }
+
+    /* Interval arithmetic needs the reciprocals to keep their sign */
+    for (int k = 0; k < 3; k++) {
+        if (invLow[k] < 0.f && invUpp[k] > 0.f)
+            intervalValid = false;
+    }
+}
+
+bool RayPacket::missesBox(const float low[3], const float upp[3]) const {
+    if (!intervalValid)
+        return false;
+
+    float tNear = 0.f;
+    float tFar = FLT_MAX;
+    for (int k = 0; k < 3; k++) {
+        /* Entry and exit distances over every origin and direction of the
+         * packet: the products of two intervals, signs being known */
+        float a = low[k] - originUpp[k]; // Smallest low - origin
+        float b = upp[k] - originLow[k]; // Largest upp - origin
+        float t0, t1;
+        if (invLow[k] >= 0.f) {
+            t0 = std::min(a * invLow[k], a * invUpp[k]);
+            t1 = std::max(b * invLow[k], b * invUpp[k]);
+        } else {
+            t0 = std::min(b * invLow[k], b * invUpp[k]);
+            t1 = std::max(a * invLow[k], a * invUpp[k]);
+        }
+        tNear = std::max(tNear, t0);
+        tFar = std::min(tFar, t1);
+    }
+
+    return tNear > tFar;
+}
+
+unsigned int RayPacket::hitBox(const float low[3], const float upp[3],
+        unsigned int active) const {
+    unsigned int mask = 0;
+
+#if defined(__AVX__)
+    for (unsigned int base = 0; base < RAY_PACKET_SIZE; base += 8) {
+        if (((active >> base) & 0xff) == 0)
+            continue;
+        __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(low[0]),
+                    _mm256_loadu_ps(ox + base)), _mm256_loadu_ps(ix + base));
+        __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(upp[0]),
+                    _mm256_loadu_ps(ox + base)), _mm256_loadu_ps(ix + base));
+        __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(low[1]),
+                    _mm256_loadu_ps(oy + base)), _mm256_loadu_ps(iy + base));
+        __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(upp[1]),
+                    _mm256_loadu_ps(oy + base)), _mm256_loadu_ps(iy + base));
+        __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(low[2]),
+                    _mm256_loadu_ps(oz + base)), _mm256_loadu_ps(iz + base));
+        __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(upp[2]),
+                    _mm256_loadu_ps(oz + base)), _mm256_loadu_ps(iz + base));
+
+        __m256 t0 = _mm256_max_ps(
+                _mm256_max_ps(_mm256_min_ps(tx0, tx1),
+                              _mm256_min_ps(ty0, ty1)),
+                _mm256_max_ps(_mm256_min_ps(tz0, tz1),
+                              _mm256_loadu_ps(tmin + base)));
+        __m256 t1 = _mm256_min_ps(
+                _mm256_min_ps(_mm256_max_ps(tx0, tx1),
+                              _mm256_max_ps(ty0, ty1)),
+                _mm256_min_ps(_mm256_max_ps(tz0, tz1),
+                              _mm256_loadu_ps(tmax + base)));
+
+        mask |= _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))
+            << base;
+    }
+#elif defined(__SSE__)
+    for (unsigned int base = 0; base < RAY_PACKET_SIZE; base += 4) {
+        if (((active >> base) & 0xf) == 0)
+            continue;
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(low[0]),
+                    _mm_loadu_ps(ox + base)), _mm_loadu_ps(ix + base));
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(upp[0]),
+                    _mm_loadu_ps(ox + base)), _mm_loadu_ps(ix + base));
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(low[1]),
+                    _mm_loadu_ps(oy + base)), _mm_loadu_ps(iy + base));
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(upp[1]),
+                    _mm_loadu_ps(oy + base)), _mm_loadu_ps(iy + base));
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(low[2]),
+                    _mm_loadu_ps(oz + base)), _mm_loadu_ps(iz + base));
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(upp[2]),
+                    _mm_loadu_ps(oz + base)), _mm_loadu_ps(iz + base));
+
+        __m128 t0 = _mm_max_ps(
+                _mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_loadu_ps(tmin + base)));
+        __m128 t1 = _mm_min_ps(
+                _mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_loadu_ps(tmax + base)));
+
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << base;
+    }
+#else
+    for (unsigned int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        float tx0 = (low[0] - ox[lane]) * ix[lane];
+        float tx1 = (upp[0] - ox[lane]) * ix[lane];
+        float ty0 = (low[1] - oy[lane]) * iy[lane];
+        float ty1 = (upp[1] - oy[lane]) * iy[lane];
+        float tz0 = (low[2] - oz[lane]) * iz[lane];
+        float tz1 = (upp[2] - oz[lane]) * iz[lane];
+        float t0 = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                            std::max(std::min(tz0, tz1), tmin[lane]));
+        float t1 = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                            std::min(std::max(tz0, tz1), tmax[lane]));
+        if (t0 <= t1)
+            mask |= 1u << lane;
+    }
+#endif
+
+    return mask & active;
+}
+
+unsigned int RayPacket::hitTriangle(const Vec3f &p0, const Vec3f &p1,
+        const Vec3f &p2, int v0, int v1, int v2, unsigned int active) const {
+    Vec3f e0 = p1 - p0;
+    Vec3f e1 = p2 - p0;
+
+    /* Same Moller-Trumbore test as Ray::rayTriangleInterDist, written over
+     * the lanes without branches so that the compiler vectorizes it */
+    int hit[RAY_PACKET_SIZE];
+    for (unsigned int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        float qx = dy[lane] * e1[2] - dz[lane] * e1[1];
+        float qy = dz[lane] * e1[0] - dx[lane] * e1[2];
+        float qz = dx[lane] * e1[1] - dy[lane] * e1[0];
+        float a = e0[0] * qx + e0[1] * qy + e0[2] * qz;
+        float invA = 1.f / a;
+
+        float sx = (ox[lane] - p0[0]) * invA;
+        float sy = (oy[lane] - p0[1]) * invA;
+        float sz = (oz[lane] - p0[2]) * invA;
+        float rx = sy * e0[2] - sz * e0[1];
+        float ry = sz * e0[0] - sx * e0[2];
+        float rz = sx * e0[1] - sy * e0[0];
+
+        float b0 = sx * qx + sy * qy + sz * qz;
+        float b1 = rx * dx[lane] + ry * dy[lane] + rz * dz[lane];
+        float t = e1[0] * rx + e1[1] * ry + e1[2] * rz;
+
+        int ignored = ignoredVertex[lane];
+        hit[lane] = (std::fabs(a) >= EPSILON) & (b0 >= 0.f) & (b0 <= 1.f)
+            & (b1 >= 0.f) & (b0 + b1 <= 1.f)
+            & (t > tmin[lane]) & (t < tmax[lane])
+            & (ignored != v0) & (ignored != v1) & (ignored != v2);
+    }
+
+    unsigned int mask = 0;
+    for (unsigned int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+        mask |= (unsigned int) hit[lane] << lane;
+    return mask & active;
+}
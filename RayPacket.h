@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Vec3.h"
+#include "Ray.h"
+
+/* Number of rays traced together, a multiple of the SIMD width */
+#define RAY_PACKET_SIZE 8
+
+/* Coherent rays stored as structures of arrays, plus the bounds of their
+ * origins and reciprocal directions. Those bounds give a conservative
+ * test that culls a box for the whole packet in one go. */
+class RayPacket {
+    private :
+        bool intervalValid; // Directions keep the same sign on each axis
+        Vec3f originLow, originUpp;
+        Vec3f invLow, invUpp;
+
+    public :
+        float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+        float dx[RAY_PACKET_SIZE], dy[RAY_PACKET_SIZE], dz[RAY_PACKET_SIZE];
+        float ix[RAY_PACKET_SIZE], iy[RAY_PACKET_SIZE], iz[RAY_PACKET_SIZE];
+        float tmin[RAY_PACKET_SIZE];
+        float tmax[RAY_PACKET_SIZE];
+        int ignoredVertex[RAY_PACKET_SIZE];
+        unsigned int size;
+
+        RayPacket() : intervalValid(false), size(0) {}
+
+        /* Adds a ray, tested over its segment. Returns its lane. */
+        unsigned int add(const Ray &ray, int ignoredVertex = -1);
+
+        /* Computes the packet bounds, to be called once all rays are in */
+        void finalize();
+
+        /* Empties the packet for reuse */
+        void clear() {size = 0;}
+
+        unsigned int fullMask() const {
+            return size >= 32 ? 0xffffffffu : (1u << size) - 1;
+        }
+
+        Ray ray(unsigned int lane) const {
+            return Ray(Vec3f(ox[lane], oy[lane], oz[lane]),
+                       Vec3f(dx[lane], dy[lane], dz[lane]),
+                       tmin[lane], tmax[lane]);
+        }
+
+        /* True if no ray of the packet can enter the box */
+        bool missesBox(const float low[3], const float upp[3]) const;
+
+        /* Slab test of every active lane, returns the lanes hitting the box */
+        unsigned int hitBox(const float low[3], const float upp[3],
+                            unsigned int active) const;
+
+        /* Tests every active lane against the triangle (p0, p1, p2) made of
+         * vertices v0, v1 and v2, skipping the lanes ignoring one of them.
+         * Returns the lanes blocked within their segment. */
+        unsigned int hitTriangle(const Vec3f &p0, const Vec3f &p1,
+                                 const Vec3f &p2, int v0, int v1, int v2,
+                                 unsigned int active) const;
+};
@@ -0,0 +1,105 @@
+#include "Sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Random.h"
+
+/* Fixed point value of [0, 1) with 32 bits, as a float */
+static inline float toUnit(uint32_t x) {
+    return (x >> 8) * (1.f / 16777216.f);
+}
+
+static inline uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+/* Second dimension of Sobol, of primitive polynomial x + 1 */
+static inline uint32_t sobol2(uint32_t j) {
+    uint32_t x = 0;
+    for (uint32_t v = 1u << 31; j != 0; j >>= 1, v ^= v >> 1) {
+        if (j & 1)
+            x ^= v;
+    }
+    return x;
+}
+
+/* Radical inverse of j in base 3, as 32 bits fixed point */
+static inline uint32_t halton3(uint32_t j) {
+    uint64_t digits = 0, scale = 1;
+    for (; j != 0; j /= 3) {
+        digits = digits * 3 + j % 3;
+        scale *= 3;
+    }
+    return (uint32_t) ((digits << 32) / scale);
+}
+
+const char * Sampler::sequenceName() const {
+    switch (sequence) {
+        case SEQUENCE_RANDOM : return "random";
+        case SEQUENCE_HALTON : return "Halton";
+        default : return "Sobol";
+    }
+}
+
+void Sampler::sample2D(uint64_t stream, uint32_t j, float &u, float &v) const {
+    /* The first two values of the stream give its rotation */
+    CounterRNG random(seed, stream);
+    uint32_t shiftU = random.nextUInt();
+    uint32_t shiftV = random.nextUInt();
+
+    uint32_t a, b;
+    switch (sequence) {
+        case SEQUENCE_RANDOM :
+            random.skip(2 * (uint64_t) j);
+            a = random.nextUInt();
+            b = random.nextUInt();
+            break;
+        case SEQUENCE_HALTON :
+            a = reverseBits(j);
+            b = halton3(j);
+            break;
+        default :
+            a = reverseBits(j);
+            b = sobol2(j);
+            break;
+    }
+
+    /* Rotating in fixed point keeps the modulo exact */
+    u = toUnit(a + shiftU);
+    v = toUnit(b + shiftV);
+}
+
+void Sampler::concentricDisk(float u, float v, float &x, float &y) {
+    float a = 2.f * u - 1.f;
+    float b = 2.f * v - 1.f;
+    float r, phi;
+    if (a == 0.f && b == 0.f) {
+        r = 0.f;
+        phi = 0.f;
+    } else if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        phi = (float) M_PI_4 * (b / a);
+    } else {
+        r = b;
+        phi = (float) M_PI_2 - (float) M_PI_4 * (a / b);
+    }
+
+    x = r * std::cos(phi);
+    y = r * std::sin(phi);
+}
+
+Vec3f Sampler::cosineHemisphere(float u, float v, const Vec3f &n,
+        const Vec3f &x, const Vec3f &y) {
+    /* Uniform points of the disk, projected on the hemisphere (Malley's
+     * method) */
+    float dx, dy;
+    concentricDisk(u, v, dx, dy);
+    float dz = std::sqrt(std::max(0.f, 1.f - dx * dx - dy * dy));
+    return dx * x + dy * y + dz * n;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Vec3.h"
+
+/* Points of [0, 1)^2 drawn from a sequence shared by every stream, each
+ * stream shifting it by its own random offset modulo 1 (Cranley-Patterson
+ * rotation). The j-th point of a stream only depends on (seed, stream, j),
+ * so that samples may be drawn in any order and by any thread. */
+class Sampler {
+    public :
+        enum Sequence {
+            SEQUENCE_RANDOM, // Independent uniform points
+            SEQUENCE_HALTON, // Radical inverses in bases 2 and 3
+            SEQUENCE_SOBOL   // First two dimensions of Sobol
+        };
+
+        Sampler(Sequence _sequence = SEQUENCE_SOBOL, uint64_t _seed = 0) :
+            sequence(_sequence), seed(_seed) {}
+
+        Sequence getSequence() const {return sequence;}
+        void setSequence(Sequence _sequence) {sequence = _sequence;}
+        const char * sequenceName() const;
+        uint64_t getSeed() const {return seed;}
+
+        /* j-th point of the stream */
+        void sample2D(uint64_t stream, uint32_t j, float &u, float &v) const;
+
+        /* Maps a point of [0, 1)^2 to (x, y) of the unit disk, keeping
+         * areas and the strata of the square compact (concentric mapping) */
+        static void concentricDisk(float u, float v, float &x, float &y);
+
+        /* Maps a point of [0, 1)^2 to a unit vector of the hemisphere
+         * around the normal n, with a density proportional to the cosine
+         * to n. x and y complete n into an orthonormal basis. */
+        static Vec3f cosineHemisphere(float u, float v, const Vec3f &n,
+                                      const Vec3f &x, const Vec3f &y);
+
+    private :
+        Sequence sequence;
+        uint64_t seed;
+};
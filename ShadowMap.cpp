@@ -0,0 +1,116 @@
+#include "ShadowMap.h"
+
+#include <GL/glu.h>
+
+#include "Exception.h"
+
+ShadowMap::ShadowMap(unsigned int _size, float _far) :
+    program(NULL), texture(0), depthBuffer(0), framebuffer(0), size(_size),
+    far(_far) {
+    if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object)
+        throw Exception("ShadowMap: framebuffer objects are not supported");
+
+    program = GLProgram::genVFProgram("Shadow Map Program", "shadow.vert",
+            "shadow.frag");
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    for (int face = 0; face < 6; face++) {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGBA8,
+                size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    /* Packed distances cannot be interpolated, PCF filters them after the
+     * comparison instead */
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+            GL_RENDERBUFFER, depthBuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_CUBE_MAP_POSITIVE_X, texture, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteRenderbuffers(1, &depthBuffer);
+        glDeleteTextures(1, &texture);
+        delete program;
+        throw Exception("ShadowMap: incomplete framebuffer");
+    }
+}
+
+ShadowMap::~ShadowMap() {
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    glDeleteTextures(1, &texture);
+    delete program;
+}
+
+void ShadowMap::render(const Vec3f &lightPos,
+        const std::function<void()> &drawScene) {
+    /* Viewing direction and up vector of each face, in the order of the
+     * GL_TEXTURE_CUBE_MAP_* faces */
+    static const float faces[6][6] = {
+        { 1, 0, 0,  0,-1, 0}, {-1, 0, 0,  0,-1, 0},
+        { 0, 1, 0,  0, 0, 1}, { 0,-1, 0,  0, 0,-1},
+        { 0, 0, 1,  0,-1, 0}, { 0, 0,-1,  0,-1, 0}
+    };
+
+    glPushAttrib(GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT | GL_ENABLE_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluPerspective(90.0, 1.0, 0.01 * far, far);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+
+    /* Both faces of the triangles are drawn, as meshes may be open */
+    glDisable(GL_CULL_FACE);
+    glViewport(0, 0, size, size);
+    glClearColor(1.f, 1.f, 1.f, 1.f); // Farthest distance
+
+    program->use();
+    program->setUniform3f("lightPos", lightPos[0], lightPos[1], lightPos[2]);
+    program->setUniform1f("far", far);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    for (int face = 0; face < 6; face++) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, texture, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        const float *f = faces[face];
+        glLoadIdentity();
+        gluLookAt(lightPos[0], lightPos[1], lightPos[2],
+                lightPos[0] + f[0], lightPos[1] + f[1], lightPos[2] + f[2],
+                f[3], f[4], f[5]);
+        drawScene();
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLProgram::stop();
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glPopAttrib();
+}
+
+void ShadowMap::bind(unsigned int unit) const {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    glActiveTexture(GL_TEXTURE0);
+}
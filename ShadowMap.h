@@ -0,0 +1,41 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <functional>
+
+#include "Vec3.h"
+#include "GLProgram.h"
+
+/* Omnidirectional shadow map of a point light: a cube map holding, for
+ * each direction from the light, the distance to the closest surface
+ * divided by far. Distances are packed in RGBA8 texels, which every
+ * OpenGL 2 driver can render to, software rasterizers included. */
+class ShadowMap {
+    private :
+        GLProgram *program; // Writes the packed distances
+        GLuint texture;
+        GLuint depthBuffer;
+        GLuint framebuffer;
+        unsigned int size;
+        float far;
+
+    public :
+        /* Throws an Exception if the context lacks framebuffer objects or
+         * the shaders do not build */
+        ShadowMap(unsigned int _size, float _far);
+        ~ShadowMap();
+
+        unsigned int getSize() const {return size;}
+        float getFar() const {return far;}
+
+        /* Renders the scene drawn by drawScene from the light, in model
+         * space, into the six faces of the cube map. Restores the
+         * viewport, the matrices and the framebuffer, but leaves no
+         * program in use. */
+        void render(const Vec3f &lightPos,
+                    const std::function<void()> &drawScene);
+
+        /* Binds the cube map to the texture unit */
+        void bind(unsigned int unit) const;
+};
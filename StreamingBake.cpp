@@ -0,0 +1,264 @@
+#include "StreamingBake.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+#include "ChunkedMesh.h"
+#include "Exception.h"
+#include "MappedFile.h"
+#include "Ray.h"
+#include "ThreadPool.h"
+
+#define STREAMING_BAKE_MAGIC "IGRVBAK"
+#define STREAMING_BAKE_VERSION 2
+#define STREAMING_BAKE_BATCH 4096 // Vertices whose rays are traced together, at least
+#define STREAMING_BAKE_RAY_SHARE 4 // Rays of a batch take this fraction of the budget, about
+#define STREAMING_BAKE_CROSSINGS 2 // Chunks a ray crosses, on average, for sizing the queues
+#define STREAMING_BAKE_GRAIN 1024 // Rays per task
+
+/* Start of the results file. Every field but verticesDone must match for
+ * a bake to resume. */
+struct StreamingBakeHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertexCount;
+    uint64_t modelSize;
+    int64_t modelTime;
+    uint64_t aoSeed;
+    uint32_t aoSamples;
+    float aoRadius;
+    uint32_t aoSequence;
+    float lightPos[3];
+    uint32_t chunkCount;
+    uint32_t verticesDone; // In the vertex order of the chunks
+};
+
+/* Rays of a batch of vertices: the AO samples of each vertex, as
+ * aoSample traces them in the viewer, then its shadow ray, a segment
+ * ending at the light. Only their directions are kept, a quarter of a
+ * Ray, which is rebuilt from them as it is tested, so that batches hold
+ * more rays, hence page the chunks they cross fewer times. */
+struct RayBatch {
+    const uint32_t *vertices;
+    unsigned int raysPerVertex;
+    float aoRadius;
+    std::vector<Vec3f> origins;    // Per vertex
+    std::vector<Vec3f> directions; // Per ray
+
+    unsigned int size() const {return directions.size();}
+    Ray ray(unsigned int r) const {
+        bool shadow = r % raysPerVertex == raysPerVertex - 1;
+        return Ray(origins[r / raysPerVertex], directions[r], RAY_EPSILON,
+                   shadow ? 1.f : aoRadius);
+    }
+};
+
+static void makeRays(const ChunkedMesh &mesh,
+        const StreamingBakeParams &params, const uint32_t *vertices,
+        unsigned int count, RayBatch &batch) {
+    unsigned int raysPerVertex = params.aoSamples + 1;
+    batch.vertices = vertices;
+    batch.raysPerVertex = raysPerVertex;
+    batch.aoRadius = params.aoRadius;
+    batch.origins.resize(count);
+    batch.directions.resize(count * raysPerVertex);
+    ThreadPool::instance().parallelFor(0, count,
+            STREAMING_BAKE_GRAIN / raysPerVertex + 1,
+            [&](unsigned int begin, unsigned int end) {
+        for (unsigned int v = begin; v < end; v++) {
+            uint32_t i = vertices[v];
+            Vec3f x, y;
+            Vec3f position = mesh.positions()[i];
+            Vec3f normal = normalize(mesh.normals()[i]);
+            normal.getTwoOrthogonals(x, y);
+            x.normalize();
+            y.normalize();
+
+            batch.origins[v] = position;
+            Vec3f *directions = &batch.directions[v * raysPerVertex];
+            for (unsigned int j = 0; j < params.aoSamples; j++) {
+                float u, w;
+                params.aoSampler.sample2D(i, j, u, w);
+                directions[j] = Sampler::cosineHemisphere(u, w, normal, x, y);
+            }
+            directions[params.aoSamples] = params.lightPos - position;
+        }
+    });
+}
+
+/* Queues the rays of the batch on the chunks they cross: queue holds the
+ * rays crossing chunk c from first[c] to first[c + 1]. Each task lists
+ * the chunks of its rays twice, to count them, then to place them, so
+ * that no pair is stored in between. */
+static void queueRays(const ChunkedMesh &mesh, const RayBatch &batch,
+        std::vector<uint64_t> &first, std::vector<uint32_t> &queue) {
+    ThreadPool &pool = ThreadPool::instance();
+    unsigned int chunkCount = mesh.getChunks().size();
+    unsigned int tasks = (batch.size() + STREAMING_BAKE_GRAIN - 1)
+        / STREAMING_BAKE_GRAIN;
+    std::vector<uint64_t> cursors((size_t) tasks * chunkCount, 0);
+    auto forTaskRays = [&](unsigned int task,
+            const std::function<void(unsigned int, unsigned int)> &f) {
+        std::vector<unsigned int> crossed;
+        unsigned int end = std::min(batch.size(),
+                                    (task + 1) * STREAMING_BAKE_GRAIN);
+        for (unsigned int r = task * STREAMING_BAKE_GRAIN; r < end; r++) {
+            mesh.crossedChunks(batch.ray(r), crossed);
+            for (unsigned int k = 0; k < crossed.size(); k++)
+                f(r, crossed[k]);
+        }
+    };
+
+    pool.parallelFor(0, tasks, 1, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int t = begin; t < end; t++) {
+            uint64_t *counts = &cursors[(size_t) t * chunkCount];
+            forTaskRays(t, [&](unsigned int, unsigned int c) {
+                counts[c]++;
+            });
+        }
+    });
+
+    /* Within a chunk, the rays of the tasks follow each other */
+    first.assign(chunkCount + 1, 0);
+    uint64_t sum = 0;
+    for (unsigned int c = 0; c < chunkCount; c++) {
+        first[c] = sum;
+        for (unsigned int t = 0; t < tasks; t++) {
+            uint64_t count = cursors[(size_t) t * chunkCount + c];
+            cursors[(size_t) t * chunkCount + c] = sum;
+            sum += count;
+        }
+    }
+    first[chunkCount] = sum;
+
+    queue.resize(sum);
+    pool.parallelFor(0, tasks, 1, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int t = begin; t < end; t++) {
+            uint64_t *counts = &cursors[(size_t) t * chunkCount];
+            forTaskRays(t, [&](unsigned int r, unsigned int c) {
+                queue[counts[c]++] = r;
+            });
+        }
+    });
+}
+
+/* Traces the rays one chunk at a time, so that each chunk they cross is
+ * paged in once for all of them, and tested against its queue only.
+ * Resident chunks go first, before the ones read drop them. */
+static void traceRays(ChunkedMesh &mesh, const RayBatch &batch,
+        std::vector<unsigned char> &blocked) {
+    std::vector<uint64_t> first;
+    std::vector<uint32_t> queue;
+    queueRays(mesh, batch, first, queue);
+
+    std::vector<unsigned int> order;
+    unsigned int chunkCount = mesh.getChunks().size();
+    for (int pass = 0; pass < 2; pass++)
+        for (unsigned int c = 0; c < chunkCount; c++)
+            if (first[c + 1] > first[c] && mesh.isResident(c) == (pass == 0))
+                order.push_back(c);
+
+    blocked.assign(batch.size(), 0);
+    for (unsigned int k = 0; k < order.size(); k++) {
+        unsigned int c = order[k];
+        std::shared_ptr<const ResidentChunk> chunk = mesh.page(c);
+        const uint32_t *rays = &queue[first[c]];
+        ThreadPool::instance().parallelFor(0, first[c + 1] - first[c],
+                STREAMING_BAKE_GRAIN,
+                [&](unsigned int begin, unsigned int end) {
+            for (unsigned int q = begin; q < end; q++) {
+                unsigned int r = rays[q];
+                if (blocked[r])
+                    continue;
+                int vertex = chunk->localVertex(
+                        batch.vertices[r / batch.raysPerVertex]);
+                blocked[r] = chunk->wideBVH->occluded(batch.ray(r), vertex);
+            }
+        });
+    }
+}
+
+void streamingBake(const std::string &modelFilename,
+        const StreamingBakeParams &params) {
+    auto start = std::chrono::steady_clock::now();
+    ChunkedMesh mesh(params.memoryBudget);
+    mesh.open(modelFilename);
+    const std::vector<MeshChunk> &chunks = mesh.getChunks();
+    unsigned int vertexCount = mesh.getVertexCount();
+
+    StreamingBakeHeader expected;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, STREAMING_BAKE_MAGIC, 8);
+    expected.version = STREAMING_BAKE_VERSION;
+    expected.vertexCount = vertexCount;
+    if (!MappedFile::stamp(modelFilename, expected.modelSize,
+                           expected.modelTime))
+        throw Exception("Cannot read " + modelFilename);
+    expected.aoSeed = params.aoSampler.getSeed();
+    expected.aoSamples = params.aoSamples;
+    expected.aoRadius = params.aoRadius;
+    expected.aoSequence = params.aoSampler.getSequence();
+    for (int k = 0; k < 3; k++)
+        expected.lightPos[k] = params.lightPos[k];
+    expected.chunkCount = chunks.size();
+
+    MappedFile file(modelFilename + ".vertexbake", sizeof(expected)
+            + 2 * (size_t) vertexCount * sizeof(float));
+    StreamingBakeHeader *header =
+        (StreamingBakeHeader *) file.writableBegin();
+    float *ao = (float *) (file.writableBegin() + sizeof(expected));
+    float *visibility = ao + vertexCount;
+
+    expected.verticesDone = header->verticesDone;
+    if (memcmp(header, &expected, sizeof(expected)) != 0
+            || header->verticesDone > vertexCount) {
+        expected.verticesDone = 0;
+        memcpy(header, &expected, sizeof(expected));
+    }
+    if (header->verticesDone > 0)
+        std::cout << "Resuming the bake of " << modelFilename
+            << " at vertex " << header->verticesDone << " of "
+            << vertexCount << std::endl;
+
+    /* Every batch pages in most of the chunks its rays cross, larger ones
+     * page them in fewer times. Batches run on across the chunks, which
+     * follow each other in space. */
+    unsigned int raysPerVertex = params.aoSamples + 1;
+    size_t bytesPerVertex = sizeof(Vec3f) + raysPerVertex
+        * (sizeof(Vec3f) + 1 + STREAMING_BAKE_CROSSINGS * sizeof(uint32_t));
+    unsigned int batchSize = std::max<size_t>(STREAMING_BAKE_BATCH,
+            params.memoryBudget / STREAMING_BAKE_RAY_SHARE / bytesPerVertex);
+    RayBatch batch;
+    std::vector<unsigned char> blocked;
+    for (unsigned int first = header->verticesDone; first < vertexCount;
+            first += batchSize) {
+        const uint32_t *vertices = mesh.vertexOrder() + first;
+        unsigned int count = std::min(vertexCount - first, batchSize);
+        makeRays(mesh, params, vertices, count, batch);
+        traceRays(mesh, batch, blocked);
+
+        for (unsigned int v = 0; v < count; v++) {
+            const unsigned char *vertexBlocked = &blocked[v * raysPerVertex];
+            float unoccluded = 0.f;
+            for (unsigned int j = 0; j < params.aoSamples; j++)
+                unoccluded += vertexBlocked[j] ? 0.f : 1.f;
+            ao[vertices[v]] = unoccluded / (float) params.aoSamples;
+            visibility[vertices[v]] =
+                vertexBlocked[params.aoSamples] ? 0.f : 1.f;
+        }
+
+        /* The results reach the file before the batch is counted done */
+        file.sync();
+        header->verticesDone = first + count;
+        file.sync();
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Baked " << vertexCount << " vertices in " << chunks.size()
+        << " chunks, with " << mesh.getPageIns() << " chunk loads, in "
+        << elapsed.count() << " s" << std::endl;
+}
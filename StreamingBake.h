@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "Vec3.h"
+#include "Sampler.h"
+
+/* Parameters of a streaming bake, the same as the ones of the viewer's */
+struct StreamingBakeParams {
+    unsigned int aoSamples;
+    float aoRadius;      // Distance beyond which occluders are ignored
+    Sampler aoSampler;
+    Vec3f lightPos;      // Of a point light
+    size_t memoryBudget; // Bytes of chunks kept resident
+};
+
+/* Bakes the AO and the point light shadows of a model that may not fit in
+ * memory, through a ChunkedMesh. Vertices are baked in the order of the
+ * chunks, in batches whose rays are traced together, and the results are
+ * written to <model>.vertexbake as each batch is done: a header, then the
+ * AO of every vertex and the visible part of the light at every vertex,
+ * one float each in the order of the model. The header counts the
+ * vertices done, so that an interrupted bake with the same parameters
+ * resumes from there.
+ * Results are the ones the viewer bakes from the loaded mesh. Throws an
+ * Exception if the model or the results cannot be read or written. */
+void streamingBake(const std::string &modelFilename,
+                   const StreamingBakeParams &params);
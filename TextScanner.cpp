@@ -0,0 +1,62 @@
+#include "TextScanner.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "Exception.h"
+
+bool TextScanner::readKeyword(const char *keyword) {
+    skipBlanks();
+    size_t length = strlen(keyword);
+    if ((size_t) (end - cursor) < length
+            || strncmp(cursor, keyword, length) != 0)
+        return false;
+
+    const char *token = cursor;
+    cursor += length;
+    if (cursor != end && !isBlank(*cursor) && *cursor != '#') {
+        cursor = token;
+        return false;
+    }
+    return true;
+}
+
+bool TextScanner::readToken(const char *&token, const char *&tokenEnd) {
+    skipBlanks();
+    token = cursor;
+    while (cursor != end && !isBlank(*cursor) && *cursor != '#')
+        cursor++;
+    tokenEnd = cursor;
+    return token != tokenEnd;
+}
+
+/* Hands the whole token to strtof, from a copy as the text does not end
+ * with a null character */
+float TextScanner::readFloatSlow(const char *token) {
+    cursor = token;
+    while (cursor != end && !isBlank(*cursor)
+            && *cursor != '#')
+        cursor++;
+    if (cursor == token)
+        error("missing value");
+
+    std::string copy(token, cursor);
+    char *parsed;
+    float value = strtof(copy.c_str(), &parsed);
+    if (parsed != copy.c_str() + copy.size()) {
+        cursor = token;
+        error("malformed number");
+    }
+    return value;
+}
+
+void TextScanner::error(const std::string &what) const {
+    unsigned int line = firstLine;
+    for (const char *c = begin; c != cursor; c++)
+        line += *c == '\n';
+
+    std::ostringstream message;
+    message << name << ":" << line << ": " << what;
+    throw Exception(message.str());
+}
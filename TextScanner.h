@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+/* Reads whitespace separated numbers from text in memory, such as a
+ * MappedFile, without any allocation per token. Comments run from '#' to
+ * the end of the line, and '\r' counts as a blank so that CRLF files read
+ * the same. Malformed input throws an Exception naming the source and the
+ * line, which is only counted then. The text may be a part of the source
+ * starting at firstLine, down to a single line. */
+class TextScanner {
+    public :
+        TextScanner(const char *_begin, const char *_end,
+                    const std::string &_name, unsigned int _firstLine = 1) :
+            begin(_begin), cursor(_begin), end(_end), name(_name),
+            firstLine(_firstLine) {}
+
+        const char * position() const {return cursor;}
+
+        /* Whether only blanks and comments are left */
+        bool atEnd() {
+            skipBlanks();
+            return cursor == end;
+        }
+
+        /* Consumes the next token if it is the keyword */
+        bool readKeyword(const char *keyword);
+
+        /* Consumes the next token, up to a blank or a comment, and returns
+         * its range. Returns false if only blanks and comments are left. */
+        bool readToken(const char *&token, const char *&tokenEnd);
+
+        inline unsigned int readUInt();
+
+        /* Rounds as strtof does: exactly in float arithmetic when both the
+         * digits and the power of ten are exact floats, else by strtof */
+        inline float readFloat();
+
+        /* Skips what is left of the current line */
+        void skipLine() {
+            const char *c = cursor;
+            while (c != end && *c != '\n')
+                c++;
+            cursor = c;
+        }
+
+        void error(const std::string &what) const;
+
+    private :
+        const char *begin;
+        const char *cursor;
+        const char *end;
+        const std::string &name; // Outlives the scanner
+        unsigned int firstLine;
+
+        static inline bool isBlank(char c);
+        static inline bool isDigit(char c);
+        inline void skipBlanks();
+        inline void expectSeparator(const char *token);
+        float readFloatSlow(const char *token);
+};
+
+/* Spaces and control characters, which covers '\r' and tabs */
+inline bool TextScanner::isBlank(char c) {
+    return (unsigned char) c <= ' ';
+}
+
+inline bool TextScanner::isDigit(char c) {
+    return (unsigned char) (c - '0') < 10;
+}
+
+inline void TextScanner::skipBlanks() {
+    const char *c = cursor;
+    while (c != end) {
+        if (isBlank(*c)) {
+            c++;
+        } else if (*c == '#') {
+            while (c != end && *c != '\n')
+                c++;
+        } else {
+            break;
+        }
+    }
+    cursor = c;
+}
+
+/* A number must end at a blank, a comment or the end of the text */
+inline void TextScanner::expectSeparator(const char *token) {
+    if (cursor == end)
+        return;
+    if (!isBlank(*cursor) && *cursor != '#') {
+        cursor = token;
+        error("malformed number");
+    }
+}
+
+/* The scanning loops work on a local copy of the cursor, which the
+ * compiler keeps in a register */
+inline unsigned int TextScanner::readUInt() {
+    skipBlanks();
+    const char *token = cursor;
+    const char *c = cursor;
+    uint64_t value = 0;
+    while (c != end && isDigit(*c) && value <= 0xffffffffu)
+        value = 10 * value + (*c++ - '0');
+    cursor = c;
+    if (value > 0xffffffffu)
+        error("integer out of range");
+    if (c == token)
+        error(c == end ? "missing value" : "expected an integer");
+    expectSeparator(token);
+    return (unsigned int) value;
+}
+
+inline float TextScanner::readFloat() {
+    static const float powersOfTen[11] = {
+        1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+    };
+
+    skipBlanks();
+    const char *token = cursor;
+    const char *c = cursor;
+    bool negative = false;
+    if (c != end && (*c == '-' || *c == '+'))
+        negative = *c++ == '-';
+
+    /* Digits beyond what a 64 bits integer holds only go to the slow path */
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    bool exact = true;
+    for (; c != end && isDigit(*c); c++) {
+        if (mantissa < (UINT64_MAX - 9) / 10)
+            mantissa = 10 * mantissa + (*c - '0');
+        else
+            exact = false;
+        digits++;
+    }
+    if (c != end && *c == '.') {
+        for (c++; c != end && isDigit(*c); c++) {
+            if (mantissa < (UINT64_MAX - 9) / 10) {
+                mantissa = 10 * mantissa + (*c - '0');
+                exponent--;
+            } else {
+                exact = false;
+            }
+            digits++;
+        }
+    }
+    if (digits == 0)
+        return readFloatSlow(token); // inf, nan, or an error
+    if (c != end && (*c == 'e' || *c == 'E')) {
+        c++;
+        bool negativeExponent = false;
+        if (c != end && (*c == '-' || *c == '+'))
+            negativeExponent = *c++ == '-';
+        if (c == end || !isDigit(*c))
+            return readFloatSlow(token);
+        int value = 0;
+        for (; c != end && isDigit(*c); c++)
+            value = std::min(10 * value + (*c - '0'), 100000);
+        exponent += negativeExponent ? -value : value;
+    }
+    cursor = c;
+    expectSeparator(token);
+
+    if (!exact || mantissa > (1u << 24) || exponent < -10 || exponent > 10)
+        return readFloatSlow(token);
+    float value = (float) mantissa;
+    value = exponent < 0 ? value / powersOfTen[-exponent]
+        : value * powersOfTen[exponent];
+    return negative ? -value : value;
+}
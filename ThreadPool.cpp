@@ -0,0 +1,231 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#define WAIT_SPINS 64 // Yields of TaskGroup::wait() before it sleeps
+
+/* Pool and queue of the calling thread, when it is a worker */
+static thread_local const ThreadPool *currentPool = NULL;
+static thread_local unsigned int currentQueue = 0;
+
+ThreadPool::ThreadPool(unsigned int threads) : queued(0), stopping(false) {
+    for (unsigned int i = 0; i < std::max(1u, threads); i++)
+        queues.push_back(std::unique_ptr<Queue>(new Queue()));
+
+    /* The thread calling parallelFor() or wait() works too */
+    for (unsigned int i = 1; i < threads; i++)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (unsigned int i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+static unsigned int defaultThreadCount() {
+    const char *env = getenv("IGR_THREADS");
+    if (env != NULL && atoi(env) > 0)
+        return atoi(env);
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+ThreadPool & ThreadPool::instance() {
+    static ThreadPool pool(defaultThreadCount());
+    return pool;
+}
+
+void ThreadPool::workerLoop(unsigned int index) {
+    currentPool = this;
+    currentQueue = index;
+
+    while (true) {
+        std::function<void()> task;
+        if (popTask(index, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this] {return stopping || queued > 0;});
+        if (stopping && queued == 0)
+            return;
+    }
+}
+
+bool ThreadPool::takeTask(Queue &queue, bool newest,
+        std::function<void()> &task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return false;
+
+    if (newest) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+    } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+    }
+    queued--;
+    return true;
+}
+
+/* Takes the newest task of the thread's own queue, else the oldest of the
+ * shared queue, else steals the oldest task of another worker */
+bool ThreadPool::popTask(unsigned int index, std::function<void()> &task) {
+    if (queued == 0)
+        return false;
+
+    if (index != 0 && takeTask(*queues[index], true, task))
+        return true;
+    if (takeTask(*queues[0], false, task))
+        return true;
+    for (unsigned int k = 1; k < queues.size(); k++) {
+        unsigned int victim = (index + k) % queues.size();
+        if (victim != 0 && takeTask(*queues[victim], false, task))
+            return true;
+    }
+    return false;
+}
+
+bool ThreadPool::runPendingTask() {
+    std::function<void()> task;
+    if (!popTask(currentPool == this ? currentQueue : 0, task))
+        return false;
+    task();
+    return true;
+}
+
+void ThreadPool::submit(const std::function<void()> &task) {
+    Queue &queue = *queues[currentPool == this ? currentQueue : 0];
+    queued++;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+    }
+
+    /* Taking the lock orders the push before the wait of a worker about
+     * to sleep, so that it cannot miss the notification */
+    { std::lock_guard<std::mutex> lock(sleepMutex); }
+    wakeUp.notify_one();
+}
+
+void ThreadPool::parallelFor(unsigned int begin, unsigned int end,
+        unsigned int grain,
+        const std::function<void(unsigned int, unsigned int)> &f) {
+    if (end <= begin)
+        return;
+
+    grain = std::max(1u, grain);
+    unsigned int chunks = (end - begin + grain - 1) / grain;
+    if (chunks == 1 || size() == 1) {
+        for (unsigned int b = begin; b < end; b += grain)
+            f(b, std::min(end, b + grain));
+        return;
+    }
+
+    /* Remaining chunks [first, last) of each runner, packed in one word so
+     * that the owner and the thieves update them with a compare-and-swap.
+     * The owner takes chunks from the front, thieves the back half. */
+    unsigned int runners = std::min(chunks, size());
+    std::vector<std::atomic<unsigned long long> > ranges(runners);
+    for (unsigned int r = 0; r < runners; r++) {
+        unsigned long long first = (unsigned long long) r * chunks / runners;
+        unsigned long long last = (unsigned long long) (r + 1) * chunks
+            / runners;
+        ranges[r] = first << 32 | last;
+    }
+
+    auto runner = [&](unsigned int self) {
+        while (true) {
+            unsigned long long range = ranges[self];
+            unsigned int first = range >> 32;
+            unsigned int last = range & 0xffffffffu;
+            if (first < last) {
+                if (ranges[self].compare_exchange_weak(range,
+                            (unsigned long long) (first + 1) << 32 | last)) {
+                    unsigned int b = begin + first * grain;
+                    f(b, std::min(end, b + grain));
+                }
+                continue;
+            }
+
+            bool stolen = false;
+            for (unsigned int k = 1; k < runners && !stolen; k++) {
+                unsigned int victim = (self + k) % runners;
+                unsigned long long other = ranges[victim];
+                unsigned int otherFirst = other >> 32;
+                unsigned int otherLast = other & 0xffffffffu;
+                if (otherFirst >= otherLast)
+                    continue;
+
+                unsigned int half = otherLast
+                    - (otherLast - otherFirst + 1) / 2;
+                if (ranges[victim].compare_exchange_strong(other,
+                            (unsigned long long) otherFirst << 32 | half)) {
+                    ranges[self] = (unsigned long long) half << 32 | otherLast;
+                    stolen = true;
+                } else {
+                    k--; // Retry the same victim
+                }
+            }
+
+            /* Every range was empty: the chunks left are being run */
+            if (!stolen)
+                return;
+        }
+    };
+
+    TaskGroup group(*this);
+    for (unsigned int r = 1; r < runners; r++)
+        group.run([&runner, r] {runner(r);});
+    runner(0);
+    group.wait();
+}
+
+/* Wakes the threads sleeping in TaskGroup::wait(), along with the idle
+ * workers, which go back to sleep */
+void ThreadPool::notifyWaiters() {
+    { std::lock_guard<std::mutex> lock(sleepMutex); }
+    wakeUp.notify_all();
+}
+
+void ThreadPool::TaskGroup::run(const std::function<void()> &task) {
+    pending++;
+    pool.submit([this, task] {
+        task();
+
+        /* The group may be gone as soon as pending reaches 0 */
+        ThreadPool &owner = pool;
+        if (--pending == 0)
+            owner.notifyWaiters();
+    });
+}
+
+/* Runs queued tasks while the group's are pending. Once there are none
+ * left to run, the thread yields for a while, as the last tasks are
+ * usually short, then sleeps until the group is done or a task is
+ * queued. */
+void ThreadPool::TaskGroup::wait() {
+    unsigned int spins = 0;
+    while (pending > 0) {
+        if (pool.runPendingTask()) {
+            spins = 0;
+            continue;
+        }
+        if (spins++ < WAIT_SPINS) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(pool.sleepMutex);
+        pool.wakeUp.wait(lock, [this] {
+            return pending == 0 || pool.queued > 0;
+        });
+    }
+}
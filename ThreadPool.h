@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed set of worker threads shared by the whole program. The thread
+ * count defaults to the number of cores and can be forced with the
+ * IGR_THREADS environment variable. Threads waiting on a TaskGroup run
+ * queued tasks meanwhile, so tasks may spawn and wait on other tasks,
+ * and sleep once there are none left to run.
+ *
+ * Each worker owns a deque: it pushes and pops its own tasks at the back,
+ * while idle threads steal the oldest ones from the front. Tasks submitted
+ * from outside the pool go to a shared queue. */
+class ThreadPool {
+    private :
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()> > tasks;
+        };
+
+        std::vector<std::thread> workers;
+        std::vector<std::unique_ptr<Queue> > queues; // Shared one first
+        std::atomic<unsigned int> queued;
+        std::mutex sleepMutex;
+        std::condition_variable wakeUp;
+        bool stopping;
+
+        void workerLoop(unsigned int index);
+        bool takeTask(Queue &queue, bool newest,
+                      std::function<void()> &task);
+        bool popTask(unsigned int index, std::function<void()> &task);
+        bool runPendingTask();
+        void notifyWaiters();
+
+    public :
+        explicit ThreadPool(unsigned int threads);
+        ~ThreadPool();
+
+        /* Pool used by every parallel algorithm of the program */
+        static ThreadPool & instance();
+
+        /* Number of threads working on a parallel loop, caller included */
+        unsigned int size() const {return workers.size() + 1;}
+
+        void submit(const std::function<void()> &task);
+
+        /* Calls f(chunkBegin, chunkEnd) over [begin, end) cut in chunks of
+         * at most grain items. Each thread starts on its own contiguous
+         * share of the chunks and, once done, steals half of what is left
+         * of another one's. */
+        void parallelFor(unsigned int begin, unsigned int end,
+                         unsigned int grain,
+                         const std::function<void(unsigned int,
+                                                  unsigned int)> &f);
+
+        /* Set of tasks that can be waited for together */
+        class TaskGroup {
+            private :
+                ThreadPool &pool;
+                std::atomic<unsigned int> pending;
+
+            public :
+                TaskGroup(ThreadPool &_pool = ThreadPool::instance()) :
+                    pool(_pool), pending(0) {}
+                ~TaskGroup() {wait();}
+
+                void run(const std::function<void()> &task);
+                void wait();
+        };
+};
@@ -46,7 +46,7 @@ public:
     
     inline unsigned int operator[] (unsigned int i) const { return m_v[i]; }
 
-	bool contains(unsigned int i) {
+	bool contains(unsigned int i) const {
 		return (i == m_v[0])
 			|| (i == m_v[1])
 			|| (i == m_v[2]);
@@ -0,0 +1,569 @@
+#include "WideBVH.h"
+#include "Triangle.h"
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+#define EPSILON 0.0001f
+
+static float nodeArea(const BVHNode &node) {
+    float dx = node.upp[0] - node.low[0];
+    float dy = node.upp[1] - node.low[1];
+    float dz = node.upp[2] - node.low[2];
+    return 2.f * (dx*dy + dy*dz + dz*dx);
+}
+
+/* Ray data of the slab tests. Huge values replace the infinite
+ * reciprocals so that the SIMD code never computes 0 * inf. */
+struct SlabRay {
+    Vec3f origin;
+    Vec3f invDir;
+    int sign[3];
+    float tmin;
+
+    SlabRay(const Ray &ray) : origin(ray.getOrigin()),
+        invDir(ray.getInvDirection()), tmin(ray.getTMin()) {
+        for (int k = 0; k < 3; k++) {
+            if (std::isinf(invDir[k]))
+                invDir[k] = invDir[k] > 0.f ? 1e30f : -1e30f;
+            sign[k] = ray.getSign(k);
+        }
+    }
+};
+
+/* Widens a child's bounds by a few ulps. A ray running exactly along a
+ * box face, with a zero direction component, would otherwise get an empty
+ * slab through the huge reciprocal and miss what lies on that face. */
+static void padBounds(float &low, float &upp) {
+    float pad = 1e-6f * (std::fabs(low) + std::fabs(upp)) + 1e-9f;
+    low -= pad;
+    upp += pad;
+}
+
+/* Slab test of one ray against all the slots of a node. The signs of the
+ * direction pick the near and far planes. Returns the bit mask of the
+ * slots entered between tmin and tmax, and their entry distances. */
+template <int N>
+static inline unsigned int hitChildren(const WideNode<N> &node,
+        const SlabRay &ray, float tmax, float tNear[N]) {
+    const float *nearX = ray.sign[0] ? node.uppX : node.lowX;
+    const float *nearY = ray.sign[1] ? node.uppY : node.lowY;
+    const float *nearZ = ray.sign[2] ? node.uppZ : node.lowZ;
+    const float *farX = ray.sign[0] ? node.lowX : node.uppX;
+    const float *farY = ray.sign[1] ? node.lowY : node.uppY;
+    const float *farZ = ray.sign[2] ? node.lowZ : node.uppZ;
+    const Vec3f &o = ray.origin;
+    const Vec3f &inv = ray.invDir;
+
+    unsigned int mask = 0;
+    for (int i = 0; i < N; i++) {
+        float t0 = std::max(std::max((nearX[i] - o[0]) * inv[0],
+                                     (nearY[i] - o[1]) * inv[1]),
+                            std::max((nearZ[i] - o[2]) * inv[2], ray.tmin));
+        float t1 = std::min(std::min((farX[i] - o[0]) * inv[0],
+                                     (farY[i] - o[1]) * inv[1]),
+                            std::min((farZ[i] - o[2]) * inv[2], tmax));
+        tNear[i] = t0;
+        if (t0 <= t1)
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef __SSE__
+template <>
+inline unsigned int hitChildren<4>(const WideNode<4> &node,
+        const SlabRay &ray, float tmax, float tNear[4]) {
+    const float *nearX = ray.sign[0] ? node.uppX : node.lowX;
+    const float *nearY = ray.sign[1] ? node.uppY : node.lowY;
+    const float *nearZ = ray.sign[2] ? node.uppZ : node.lowZ;
+    const float *farX = ray.sign[0] ? node.lowX : node.uppX;
+    const float *farY = ray.sign[1] ? node.lowY : node.uppY;
+    const float *farZ = ray.sign[2] ? node.lowZ : node.uppZ;
+    __m128 ox = _mm_set1_ps(ray.origin[0]);
+    __m128 oy = _mm_set1_ps(ray.origin[1]);
+    __m128 oz = _mm_set1_ps(ray.origin[2]);
+    __m128 ix = _mm_set1_ps(ray.invDir[0]);
+    __m128 iy = _mm_set1_ps(ray.invDir[1]);
+    __m128 iz = _mm_set1_ps(ray.invDir[2]);
+
+    __m128 t0 = _mm_max_ps(
+            _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearX), ox), ix),
+                       _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearY), oy), iy)),
+            _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearZ), oz), iz),
+                       _mm_set1_ps(ray.tmin)));
+    __m128 t1 = _mm_min_ps(
+            _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farX), ox), ix),
+                       _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farY), oy), iy)),
+            _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farZ), oz), iz),
+                       _mm_set1_ps(tmax)));
+
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#ifdef __AVX__
+template <>
+inline unsigned int hitChildren<8>(const WideNode<8> &node,
+        const SlabRay &ray, float tmax, float tNear[8]) {
+    const float *nearX = ray.sign[0] ? node.uppX : node.lowX;
+    const float *nearY = ray.sign[1] ? node.uppY : node.lowY;
+    const float *nearZ = ray.sign[2] ? node.uppZ : node.lowZ;
+    const float *farX = ray.sign[0] ? node.lowX : node.uppX;
+    const float *farY = ray.sign[1] ? node.lowY : node.uppY;
+    const float *farZ = ray.sign[2] ? node.lowZ : node.uppZ;
+    __m256 ox = _mm256_set1_ps(ray.origin[0]);
+    __m256 oy = _mm256_set1_ps(ray.origin[1]);
+    __m256 oz = _mm256_set1_ps(ray.origin[2]);
+    __m256 ix = _mm256_set1_ps(ray.invDir[0]);
+    __m256 iy = _mm256_set1_ps(ray.invDir[1]);
+    __m256 iz = _mm256_set1_ps(ray.invDir[2]);
+
+    __m256 t0 = _mm256_max_ps(
+            _mm256_max_ps(
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearX), ox), ix),
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearY), oy), iy)),
+            _mm256_max_ps(
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearZ), oz), iz),
+                _mm256_set1_ps(ray.tmin)));
+    __m256 t1 = _mm256_min_ps(
+            _mm256_min_ps(
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farX), ox), ix),
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farY), oy), iy)),
+            _mm256_min_ps(
+                _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farZ), oz), iz),
+                _mm256_set1_ps(tmax)));
+
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+/* Moller-Trumbore test of one ray against all the lanes of a block, as in
+ * Ray::rayTriangleInter. Returns the bit mask of the lanes hit between
+ * tmin and tmax, and their distances and barycentrics. */
+template <int N>
+static inline unsigned int hitTriangles(const TriangleBlock<N> &block,
+        const Vec3f &o, const Vec3f &d, float tmin, float tmax,
+        float t[N], float u[N], float v[N]) {
+    unsigned int mask = 0;
+    for (int i = 0; i < N; i++) {
+        float qx = d[1] * block.e1Z[i] - d[2] * block.e1Y[i];
+        float qy = d[2] * block.e1X[i] - d[0] * block.e1Z[i];
+        float qz = d[0] * block.e1Y[i] - d[1] * block.e1X[i];
+        float a = block.e0X[i] * qx + block.e0Y[i] * qy + block.e0Z[i] * qz;
+        float invA = 1.f / a;
+
+        float sx = (o[0] - block.p0X[i]) * invA;
+        float sy = (o[1] - block.p0Y[i]) * invA;
+        float sz = (o[2] - block.p0Z[i]) * invA;
+        float rx = sy * block.e0Z[i] - sz * block.e0Y[i];
+        float ry = sz * block.e0X[i] - sx * block.e0Z[i];
+        float rz = sx * block.e0Y[i] - sy * block.e0X[i];
+
+        u[i] = sx * qx + sy * qy + sz * qz;
+        v[i] = rx * d[0] + ry * d[1] + rz * d[2];
+        t[i] = block.e1X[i] * rx + block.e1Y[i] * ry + block.e1Z[i] * rz;
+        if (std::fabs(a) >= EPSILON && u[i] >= 0.f && u[i] <= 1.f
+                && v[i] >= 0.f && u[i] + v[i] <= 1.f
+                && t[i] > tmin && t[i] < tmax)
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef __SSE__
+template <>
+inline unsigned int hitTriangles<4>(const TriangleBlock<4> &block,
+        const Vec3f &o, const Vec3f &d, float tmin, float tmax,
+        float t[4], float u[4], float v[4]) {
+    __m128 dx = _mm_set1_ps(d[0]);
+    __m128 dy = _mm_set1_ps(d[1]);
+    __m128 dz = _mm_set1_ps(d[2]);
+    __m128 e0x = _mm_loadu_ps(block.e0X);
+    __m128 e0y = _mm_loadu_ps(block.e0Y);
+    __m128 e0z = _mm_loadu_ps(block.e0Z);
+    __m128 e1x = _mm_loadu_ps(block.e1X);
+    __m128 e1y = _mm_loadu_ps(block.e1Y);
+    __m128 e1z = _mm_loadu_ps(block.e1Z);
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, qx),
+                _mm_mul_ps(e0y, qy)), _mm_mul_ps(e0z, qz));
+    __m128 invA = _mm_div_ps(_mm_set1_ps(1.f), a);
+
+    __m128 sx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(o[0]),
+                _mm_loadu_ps(block.p0X)), invA);
+    __m128 sy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(o[1]),
+                _mm_loadu_ps(block.p0Y)), invA);
+    __m128 sz = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(o[2]),
+                _mm_loadu_ps(block.p0Z)), invA);
+    __m128 rx = _mm_sub_ps(_mm_mul_ps(sy, e0z), _mm_mul_ps(sz, e0y));
+    __m128 ry = _mm_sub_ps(_mm_mul_ps(sz, e0x), _mm_mul_ps(sx, e0z));
+    __m128 rz = _mm_sub_ps(_mm_mul_ps(sx, e0y), _mm_mul_ps(sy, e0x));
+
+    __m128 b0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, qx),
+                _mm_mul_ps(sy, qy)), _mm_mul_ps(sz, qz));
+    __m128 b1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, dx),
+                _mm_mul_ps(ry, dy)), _mm_mul_ps(rz, dz));
+    __m128 tt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, rx),
+                _mm_mul_ps(e1y, ry)), _mm_mul_ps(e1z, rz));
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 epsilon = _mm_set1_ps(EPSILON);
+    __m128 absA = _mm_andnot_ps(_mm_set1_ps(-0.f), a);
+    __m128 hit = _mm_and_ps(_mm_cmpge_ps(absA, epsilon),
+            _mm_and_ps(_mm_cmpge_ps(b0, zero), _mm_cmple_ps(b0, one)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(b1, zero),
+                _mm_cmple_ps(_mm_add_ps(b0, b1), one)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(tt, _mm_set1_ps(tmin)),
+                _mm_cmplt_ps(tt, _mm_set1_ps(tmax))));
+
+    _mm_storeu_ps(t, tt);
+    _mm_storeu_ps(u, b0);
+    _mm_storeu_ps(v, b1);
+    return _mm_movemask_ps(hit);
+}
+#endif
+
+#ifdef __AVX__
+template <>
+inline unsigned int hitTriangles<8>(const TriangleBlock<8> &block,
+        const Vec3f &o, const Vec3f &d, float tmin, float tmax,
+        float t[8], float u[8], float v[8]) {
+    __m256 dx = _mm256_set1_ps(d[0]);
+    __m256 dy = _mm256_set1_ps(d[1]);
+    __m256 dz = _mm256_set1_ps(d[2]);
+    __m256 e0x = _mm256_loadu_ps(block.e0X);
+    __m256 e0y = _mm256_loadu_ps(block.e0Y);
+    __m256 e0z = _mm256_loadu_ps(block.e0Z);
+    __m256 e1x = _mm256_loadu_ps(block.e1X);
+    __m256 e1y = _mm256_loadu_ps(block.e1Y);
+    __m256 e1z = _mm256_loadu_ps(block.e1Z);
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(dy, e1z), _mm256_mul_ps(dz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(dz, e1x), _mm256_mul_ps(dx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(dx, e1y), _mm256_mul_ps(dy, e1x));
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0x, qx),
+                _mm256_mul_ps(e0y, qy)), _mm256_mul_ps(e0z, qz));
+    __m256 invA = _mm256_div_ps(_mm256_set1_ps(1.f), a);
+
+    __m256 sx = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(o[0]),
+                _mm256_loadu_ps(block.p0X)), invA);
+    __m256 sy = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(o[1]),
+                _mm256_loadu_ps(block.p0Y)), invA);
+    __m256 sz = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(o[2]),
+                _mm256_loadu_ps(block.p0Z)), invA);
+    __m256 rx = _mm256_sub_ps(_mm256_mul_ps(sy, e0z), _mm256_mul_ps(sz, e0y));
+    __m256 ry = _mm256_sub_ps(_mm256_mul_ps(sz, e0x), _mm256_mul_ps(sx, e0z));
+    __m256 rz = _mm256_sub_ps(_mm256_mul_ps(sx, e0y), _mm256_mul_ps(sy, e0x));
+
+    __m256 b0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, qx),
+                _mm256_mul_ps(sy, qy)), _mm256_mul_ps(sz, qz));
+    __m256 b1 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rx, dx),
+                _mm256_mul_ps(ry, dy)), _mm256_mul_ps(rz, dz));
+    __m256 tt = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, rx),
+                _mm256_mul_ps(e1y, ry)), _mm256_mul_ps(e1z, rz));
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 epsilon = _mm256_set1_ps(EPSILON);
+    __m256 absA = _mm256_andnot_ps(_mm256_set1_ps(-0.f), a);
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(absA, epsilon, _CMP_GE_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(b0, zero, _CMP_GE_OQ),
+                          _mm256_cmp_ps(b0, one, _CMP_LE_OQ)));
+    hit = _mm256_and_ps(hit, _mm256_and_ps(
+                _mm256_cmp_ps(b1, zero, _CMP_GE_OQ),
+                _mm256_cmp_ps(_mm256_add_ps(b0, b1), one, _CMP_LE_OQ)));
+    hit = _mm256_and_ps(hit, _mm256_and_ps(
+                _mm256_cmp_ps(tt, _mm256_set1_ps(tmin), _CMP_GT_OQ),
+                _mm256_cmp_ps(tt, _mm256_set1_ps(tmax), _CMP_LT_OQ)));
+
+    _mm256_storeu_ps(t, tt);
+    _mm256_storeu_ps(u, b0);
+    _mm256_storeu_ps(v, b1);
+    return _mm256_movemask_ps(hit);
+}
+#endif
+
+template <int N>
+WideBVH<N>::WideBVH(const BVH &bvh) : mesh(bvh.getMesh()) {
+    if (!bvh.getNodes().empty())
+        collapse(bvh, 0);
+}
+
+template <int N>
+WideBVH<N>::WideBVH(const Mesh &_mesh, std::vector<WideNode<N> > &_nodes,
+        std::vector<TriangleBlock<N> > &_blocks) : mesh(&_mesh) {
+    nodes.swap(_nodes);
+    blocks.swap(_blocks);
+}
+
+/* Packs the triangles of a binary leaf into consecutive blocks, returns
+ * the index of the first one */
+template <int N>
+unsigned int WideBVH<N>::packLeaf(const BVH &bvh, const BVHNode &leaf) {
+    const MeshArray<Vec3f> &positions = mesh->positions();
+    const MeshArray<Triangle> &triangles = mesh->triangles();
+    const std::vector<int> &tri_index = bvh.getIndexes();
+
+    unsigned int first = blocks.size();
+    for (unsigned int i = 0; i < leaf.count; i++) {
+        if (i % N == 0) {
+            blocks.push_back(TriangleBlock<N>());
+            TriangleBlock<N> &block = blocks.back();
+            for (int lane = 0; lane < N; lane++) {
+                block.p0X[lane] = block.p0Y[lane] = block.p0Z[lane] = 0.f;
+                block.e0X[lane] = block.e0Y[lane] = block.e0Z[lane] = 0.f;
+                block.e1X[lane] = block.e1Y[lane] = block.e1Z[lane] = 0.f;
+                block.triangle[lane] = -1;
+            }
+        }
+
+        TriangleBlock<N> &block = blocks.back();
+        int lane = i % N;
+        int index = tri_index[leaf.offset + i];
+        const Triangle &tri = triangles[index];
+        Vec3f p0 = positions[tri[0]];
+        Vec3f e0 = positions[tri[1]] - p0;
+        Vec3f e1 = positions[tri[2]] - p0;
+        block.p0X[lane] = p0[0];
+        block.p0Y[lane] = p0[1];
+        block.p0Z[lane] = p0[2];
+        block.e0X[lane] = e0[0];
+        block.e0Y[lane] = e0[1];
+        block.e0Z[lane] = e0[2];
+        block.e1X[lane] = e1[0];
+        block.e1Y[lane] = e1[1];
+        block.e1Z[lane] = e1[2];
+        block.triangle[lane] = index;
+    }
+    return first;
+}
+
+/* Emits the wide node replacing the binary subtree at root */
+template <int N>
+unsigned int WideBVH<N>::collapse(const BVH &bvh, unsigned int root) {
+    const std::vector<BVHNode> &binary = bvh.getNodes();
+    std::vector<unsigned int> children;
+    if (binary[root].isLeaf()) {
+        children.push_back(root);
+    } else {
+        children.push_back(root + 1);
+        children.push_back(binary[root].offset);
+    }
+
+    /* Opening the largest interior child first keeps the area of the
+     * remaining children, hence the traversal cost, the lowest */
+    while (children.size() < N) {
+        int largest = -1;
+        float largestArea = -1.f;
+        for (unsigned int i = 0; i < children.size(); i++) {
+            const BVHNode &child = binary[children[i]];
+            if (!child.isLeaf() && nodeArea(child) > largestArea) {
+                largest = i;
+                largestArea = nodeArea(child);
+            }
+        }
+        if (largest < 0)
+            break;
+
+        unsigned int opened = children[largest];
+        children[largest] = opened + 1;
+        children.push_back(binary[opened].offset);
+    }
+
+    unsigned int index = nodes.size();
+    nodes.push_back(WideNode<N>());
+
+    for (int i = 0; i < N; i++) {
+        WideNode<N> &node = nodes[index];
+        node.childCount = children.size();
+        if (i >= (int) children.size()) {
+            node.lowX[i] = node.lowY[i] = node.lowZ[i] = 0.f;
+            node.uppX[i] = node.uppY[i] = node.uppZ[i] = 0.f;
+            node.offset[i] = 0;
+            node.count[i] = 0;
+            continue;
+        }
+
+        const BVHNode &child = binary[children[i]];
+        node.lowX[i] = child.low[0];
+        node.lowY[i] = child.low[1];
+        node.lowZ[i] = child.low[2];
+        node.uppX[i] = child.upp[0];
+        node.uppY[i] = child.upp[1];
+        node.uppZ[i] = child.upp[2];
+        padBounds(node.lowX[i], node.uppX[i]);
+        padBounds(node.lowY[i], node.uppY[i]);
+        padBounds(node.lowZ[i], node.uppZ[i]);
+        node.count[i] = child.count;
+        node.offset[i] = child.count ? packLeaf(bvh, child) : 0;
+    }
+
+    /* Interior children are emitted after their parent is filled, as the
+     * node array may be reallocated */
+    for (unsigned int i = 0; i < children.size(); i++) {
+        if (!binary[children[i]].isLeaf()) {
+            unsigned int child = collapse(bvh, children[i]);
+            nodes[index].offset[i] = child;
+        }
+    }
+
+    return index;
+}
+
+template <int N>
+int WideBVH<N>::occluder(const Ray &ray, int ignoredVertex) const {
+    if (nodes.empty())
+        return -1;
+
+    const MeshArray<Triangle> &triangles = mesh->triangles();
+
+    const Vec3f &origin = ray.getOrigin();
+    const Vec3f &direction = ray.getDirection();
+    SlabRay slab(ray);
+    float tmin = ray.getTMin();
+    float tmax = ray.getTMax();
+
+    unsigned int stack[BVH_STACK_SIZE * N];
+    unsigned int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const WideNode<N> &node = nodes[stack[--stackSize]];
+
+        float tNear[N];
+        unsigned int mask = hitChildren<N>(node, slab, tmax, tNear)
+            & ((1u << node.childCount) - 1);
+
+        for (int i = 0; mask != 0; i++, mask >>= 1) {
+            if (!(mask & 1))
+                continue;
+
+            if (node.count[i] == 0) {
+                stack[stackSize++] = node.offset[i];
+                continue;
+            }
+
+            unsigned int last = node.offset[i] + (node.count[i] + N - 1) / N;
+            for (unsigned int b = node.offset[i]; b < last; b++) {
+                float t[N], u[N], v[N];
+                unsigned int lanes = hitTriangles<N>(blocks[b], origin,
+                        direction, tmin, tmax, t, u, v);
+
+                /* Triangles around the ignored vertex are filtered out
+                 * once hit, which seldom happens */
+                for (; lanes != 0; lanes &= lanes - 1) {
+                    int index = blocks[b].triangle[__builtin_ctz(lanes)];
+                    if (ignoredVertex < 0 ||
+                            !triangles[index].contains(ignoredVertex))
+                        return index;
+                }
+            }
+        }
+    }
+
+    return -1;
+}
+
+template <int N>
+bool WideBVH<N>::intersect(const Ray &ray, Hit &hit,
+        int ignoredVertex) const {
+    if (nodes.empty())
+        return false;
+
+    const MeshArray<Triangle> &triangles = mesh->triangles();
+
+    const Vec3f &origin = ray.getOrigin();
+    const Vec3f &direction = ray.getDirection();
+    SlabRay slab(ray);
+    float tmin = ray.getTMin();
+
+    /* The ray is clipped to the closest hit found so far */
+    float tmax = std::min(hit.t, ray.getTMax());
+
+    unsigned int stack[BVH_STACK_SIZE * N];
+    float stackNear[BVH_STACK_SIZE * N];
+    unsigned int stackSize = 0;
+    stack[stackSize] = 0;
+    stackNear[stackSize++] = 0.f;
+    bool found = false;
+
+    while (stackSize > 0) {
+        stackSize--;
+        if (stackNear[stackSize] > tmax)
+            continue;
+        const WideNode<N> &node = nodes[stack[stackSize]];
+
+        float tNear[N];
+        unsigned int mask = hitChildren<N>(node, slab, tmax, tNear)
+            & ((1u << node.childCount) - 1);
+
+        /* Children hit, sorted front-to-back */
+        int order[N];
+        int hits = 0;
+        for (int i = 0; mask != 0; i++, mask >>= 1) {
+            if (!(mask & 1))
+                continue;
+            int k = hits++;
+            while (k > 0 && tNear[order[k - 1]] > tNear[i]) {
+                order[k] = order[k - 1];
+                k--;
+            }
+            order[k] = i;
+        }
+
+        /* Leaves are tested right away, nearest first, so that they clip
+         * the ray before the interior children are stacked */
+        for (int h = 0; h < hits; h++) {
+            int i = order[h];
+            if (node.count[i] == 0 || tNear[i] > tmax)
+                continue;
+
+            unsigned int last = node.offset[i] + (node.count[i] + N - 1) / N;
+            for (unsigned int b = node.offset[i]; b < last; b++) {
+                float t[N], u[N], v[N];
+                unsigned int lanes = hitTriangles<N>(blocks[b], origin,
+                        direction, tmin, tmax, t, u, v);
+
+                for (; lanes != 0; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    int index = blocks[b].triangle[lane];
+                    if (t[lane] >= tmax || (ignoredVertex >= 0 &&
+                            triangles[index].contains(ignoredVertex)))
+                        continue;
+
+                    tmax = t[lane];
+                    hit.t = t[lane];
+                    hit.triangle = index;
+                    hit.u = u[lane];
+                    hit.v = v[lane];
+                    found = true;
+                }
+            }
+        }
+
+        /* The nearest interior child is pushed last */
+        for (int h = hits - 1; h >= 0; h--) {
+            int i = order[h];
+            if (node.count[i] == 0 && tNear[i] <= tmax) {
+                stack[stackSize] = node.offset[i];
+                stackNear[stackSize++] = tNear[i];
+            }
+        }
+    }
+
+    return found;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "BVH.h"
+
+/* Widest node the build machine has SIMD registers for */
+#ifdef __AVX__
+#define BVH_WIDTH 8
+#else
+#define BVH_WIDTH 4
+#endif
+
+/* A node with up to N children, whose bounds are stored as structures of
+ * arrays so that one ray is tested against all of them at once. Children
+ * fill the first childCount slots. */
+template <int N>
+struct WideNode {
+    float lowX[N];
+    float lowY[N];
+    float lowZ[N];
+    float uppX[N];
+    float uppY[N];
+    float uppZ[N];
+    unsigned int offset[N]; // Leaf: first triangle block
+                            // Interior: index of the child node
+    unsigned short count[N]; // Leaf triangle count, 0 for interior nodes
+    unsigned int childCount;
+};
+
+/* Leaf triangles packed N at a time, as their first vertex and two edges,
+ * so that one ray is tested against all of them at once. Unused lanes have
+ * null edges, which no ray can hit, and a -1 triangle index. */
+template <int N>
+struct TriangleBlock {
+    float p0X[N];
+    float p0Y[N];
+    float p0Z[N];
+    float e0X[N]; // p1 - p0
+    float e0Y[N];
+    float e0Z[N];
+    float e1X[N]; // p2 - p0
+    float e1Y[N];
+    float e1Z[N];
+    int triangle[N];
+};
+
+/* N-wide BVH collapsed from a binary one: each node pulls in the children
+ * of its largest interior children until it holds N of them. */
+template <int N>
+class WideBVH {
+    private :
+        const Mesh * mesh;
+        std::vector<WideNode<N> > nodes;
+        std::vector<TriangleBlock<N> > blocks;
+
+        unsigned int collapse(const BVH &bvh, unsigned int root);
+        unsigned int packLeaf(const BVH &bvh, const BVHNode &leaf);
+
+    public :
+        WideBVH(const BVH &bvh);
+        /* Takes over the arrays of a tree collapsed before, such as one
+         * read from a MeshCache, leaving them empty */
+        WideBVH(const Mesh &_mesh, std::vector<WideNode<N> > &_nodes,
+                std::vector<TriangleBlock<N> > &_blocks);
+
+        const std::vector<WideNode<N> > & getNodes() const {return nodes;}
+        const std::vector<TriangleBlock<N> > & getBlocks() const {
+            return blocks;
+        }
+
+        /* Same queries as the binary BVH */
+        bool occluded(const Ray &ray, int ignoredVertex = -1) const {
+            return occluder(ray, ignoredVertex) >= 0;
+        }
+        /* Index of a triangle blocking the ray, -1 if there is none */
+        int occluder(const Ray &ray, int ignoredVertex = -1) const;
+        bool intersect(const Ray &ray, Hit &hit,
+                       int ignoredVertex = -1) const;
+};
@@ -25,6 +25,7 @@ struct LightSource {
 varying vec4 P; // fragment-wise position
 varying vec3 N; // fragment-wise normal
 varying vec4 C; // fragment-wise normal
+varying vec3 B; // fragment-wise bent normal
 
 uniform vec3 kd;
 uniform vec3 ks;
@@ -36,6 +37,11 @@ uniform float shininess;
 uniform int brdf_mode;
 uniform vec3 lightPos;
 uniform vec3 lightColor;
+uniform int shadowMapping; // 1 to take the light visibility from the shadow map
+uniform samplerCube shadowMap; // Distances to the light, divided by shadowFar
+uniform float shadowFar;
+uniform float shadowMapSize;
+uniform int bentNormalShading; // 1 to shade the diffuse term with B
 
 LightSource lightSource;
 vec3 diffuse = vec3(C);
@@ -49,6 +55,8 @@ void cook();
 float gGGX(vec3, vec3);
 float dGGX(vec3, vec3);
 void ggx();
+float shadowMapVisibility();
+vec3 diffuseNormal();
 
 void main (void) {
     gl_FragColor = vec4 (0.0, 0.0, 0.0, 1.0);
@@ -66,10 +74,9 @@ void main (void) {
 
     vec4 color = vec4((spec + diffuse), 1.0);
 
-    if (C.w > 0.0)
-        color *= 15.0 * C.w;
-    else
-        color *= -5.0 * C.w;
+    color *= 15.0 * C.w;
+    if (shadowMapping == 1)
+        color *= 1.0/3.0 + 2.0/3.0 * shadowMapVisibility();
 
     gl_FragColor += color;
 }
@@ -91,7 +98,7 @@ void blinn()
     /* Diffuse */
     vec3 f_d = kd/M_PI;
     diffuse += attenuation * lightSource.intensity *
-        lightColor * dot(n, wi)* matAlbedo * f_d;
+        lightColor * dot(diffuseNormal(), wi)* matAlbedo * f_d;
 
     /* Specular */
     vec3 r = 2.0*dot(wi, n)*n - wi;
@@ -139,7 +146,7 @@ void cook()
     /* Diffuse */
     vec3 f_d = kd/M_PI;
     diffuse += attenuation * lightSource.intensity *
-        lightColor * dot(n, wi) * matAlbedo * f_d;
+        lightColor * dot(diffuseNormal(), wi) * matAlbedo * f_d;
 
     /* Specular */
     //float f = 1.0;
@@ -183,7 +190,7 @@ void ggx()
     /* Diffuse */
     vec3 f_d = kd/M_PI;
     diffuse += attenuation * lightSource.intensity *
-        lightColor * dot(n, wi) * matAlbedo * f_d;
+        lightColor * dot(diffuseNormal(), wi) * matAlbedo * f_d;
 
     /* Specular */
     float f = fresnel(wh, wi);
@@ -193,3 +200,42 @@ void ggx()
     spec += attenuation * lightSource.intensity * dot(n, wi)
         * f_s * lightColor;
 }
+
+/* The bent normal leans away from the occluders, so that the light
+ * grazing the surface from an occluded side fades out */
+vec3 diffuseNormal()
+{
+    if (bentNormalShading == 1)
+        return normalize (gl_NormalMatrix * B);
+    return normalize (gl_NormalMatrix * N);
+}
+
+float unpackDistance(vec4 bytes)
+{
+    return dot(bytes, vec4(1.0, 1.0/255.0, 1.0/65025.0, 1.0/16581375.0));
+}
+
+/* Fraction of the 3x3 shadow map texels around the direction of the
+ * fragment that see it from the light (percentage closer filtering) */
+float shadowMapVisibility()
+{
+    vec3 d = vec3(P) - lightPos;
+    float dist = length(d);
+    d /= dist;
+    vec3 axis = abs(d.x) < 0.9 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0);
+    vec3 t = normalize(cross(d, axis));
+    vec3 b = cross(d, t);
+
+    /* A texel spans about 2 / size radians, the bias grows with it */
+    float texel = 2.0 / shadowMapSize;
+    float bias = 4.0 * texel * dist + 0.002;
+    float lit = 0.0;
+    for (int i = -1; i <= 1; i++) {
+        for (int j = -1; j <= 1; j++) {
+            vec3 s = d + (float(i) * t + float(j) * b) * texel;
+            float stored = unpackDistance(textureCube(shadowMap, s));
+            lit += dist - bias <= stored * shadowFar ? 1.0 : 0.0;
+        }
+    }
+    return lit / 9.0;
+}
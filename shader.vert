@@ -10,10 +10,14 @@ varying vec4 P;
 varying vec3 N;
 varying vec4 C;
 varying float shadow;
+varying vec3 B;
+
+attribute vec3 bentNormal; // Mean unoccluded direction, from the AO bake
 
 void main(void) {
     P = gl_Vertex;
     N = gl_Normal;
+    B = bentNormal;
     C = gl_Color;
     gl_Position = ftransform ();
 }
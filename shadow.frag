@@ -0,0 +1,19 @@
+// ----------------------------------------------
+// Shadow map pass: distance from the light to the surfaces, divided by
+// far and packed in the four 8 bits channels.
+// ----------------------------------------------
+
+varying vec3 P; // Model space position
+
+uniform vec3 lightPos;
+uniform float far;
+
+vec4 packDistance(float d)
+{
+    vec4 bytes = fract(d * vec4(1.0, 255.0, 65025.0, 16581375.0));
+    return bytes - bytes.yzww * vec4(1.0/255.0, 1.0/255.0, 1.0/255.0, 0.0);
+}
+
+void main (void) {
+    gl_FragColor = packDistance(min(length(P - lightPos) / far, 0.999));
+}
@@ -0,0 +1,10 @@
+// ----------------------------------------------
+// Shadow map pass: distance from the light to the surfaces.
+// ----------------------------------------------
+
+varying vec3 P; // Model space position
+
+void main(void) {
+    P = gl_Vertex.xyz;
+    gl_Position = ftransform ();
+}